@@ -0,0 +1,128 @@
+/*
+ *   fields_bench.c	CPU cost of decoding samples, by field selection
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Builds BENCH_MSGS synthetic PSAMPLE_CMD_SAMPLE messages, laid out as the
+ * kernel does, decodes them ROUNDS times with every field, then as many times
+ * with only the group, rate and original size, and prints the time spent per
+ * sample in each run. Needs neither the psample module nor samples.
+ */
+
+#include <psample.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libmnl/libmnl.h>
+#include <linux/genetlink.h>
+#include <linux/psample.h>
+
+#define BENCH_MSGS	64
+#define BENCH_DATA_LEN	128
+
+static __u64 bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The attributes of a sample of a tc sample action, truncated to
+ * BENCH_DATA_LEN bytes, with the hardware attributes of a switch ASIC.
+ */
+static size_t bench_msgs_build(char *buf, unsigned int count)
+{
+	static const __u8 data[BENCH_DATA_LEN];
+	struct genlmsghdr *genl;
+	struct nlmsghdr *nlh;
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		nlh = mnl_nlmsg_put_header(buf + len);
+		nlh->nlmsg_type = GENL_MIN_ID;
+		genl = mnl_nlmsg_put_extra_header(nlh, sizeof(*genl));
+		genl->cmd = PSAMPLE_CMD_SAMPLE;
+		genl->version = PSAMPLE_GENL_VERSION;
+
+		mnl_attr_put_u16(nlh, PSAMPLE_ATTR_IIFINDEX, 2);
+		mnl_attr_put_u16(nlh, PSAMPLE_ATTR_OIFINDEX, 3);
+		mnl_attr_put_u32(nlh, PSAMPLE_ATTR_ORIGSIZE, 1500);
+		mnl_attr_put_u32(nlh, PSAMPLE_ATTR_SAMPLE_GROUP, 1);
+		mnl_attr_put_u32(nlh, PSAMPLE_ATTR_GROUP_SEQ, i);
+		mnl_attr_put_u32(nlh, PSAMPLE_ATTR_SAMPLE_RATE, 1000);
+		mnl_attr_put(nlh, PSAMPLE_ATTR_DATA, sizeof(data), data);
+		mnl_attr_put_u16(nlh, PSAMPLE_ATTR_OUT_TC, 0);
+		mnl_attr_put_u64(nlh, PSAMPLE_ATTR_OUT_TC_OCC, 4096);
+		mnl_attr_put_u64(nlh, PSAMPLE_ATTR_LATENCY, 1000);
+		mnl_attr_put_u64(nlh, PSAMPLE_ATTR_TIMESTAMP, 1);
+		mnl_attr_put_u16(nlh, PSAMPLE_ATTR_PROTO, 0x0800);
+
+		len += nlh->nlmsg_len;
+	}
+
+	return len;
+}
+
+static int bench_msg_cb(const struct psample_msg *msg, void *data)
+{
+	struct psample_msg_fields fields;
+	__u64 *sum = data;
+
+	psample_msg_get(msg, &fields);
+	*sum += fields.group + fields.rate + fields.origsize;
+	return 0;
+}
+
+static int bench_run(const char *buf, size_t len, __u32 fields,
+		     const char *name, unsigned long rounds)
+{
+	__u64 sum = 0;
+	unsigned long i;
+	__u64 start;
+	int err;
+
+	start = bench_ns();
+	for (i = 0; i < rounds; i++) {
+		err = psample_dispatch_buf(buf, len, fields, bench_msg_cb, &sum,
+					   NULL, NULL);
+		if (err)
+			return err;
+	}
+
+	printf("%-8s %8.1f ns/sample (sum %llu)\n", name,
+	       (double)(bench_ns() - start) / rounds / BENCH_MSGS,
+	       (unsigned long long)sum);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	size_t len;
+	char *buf;
+	int err;
+
+	if (!rounds)
+		return 1;
+
+	buf = malloc(BENCH_MSGS * MNL_SOCKET_BUFFER_SIZE);
+	if (!buf)
+		return 1;
+	len = bench_msgs_build(buf, BENCH_MSGS);
+
+	err = bench_run(buf, len, PSAMPLE_FIELD_ALL, "all", rounds);
+	if (!err)
+		err = bench_run(buf, len, PSAMPLE_FIELD_GROUP |
+					  PSAMPLE_FIELD_RATE |
+					  PSAMPLE_FIELD_ORIGSIZE,
+				"selected", rounds);
+
+	free(buf);
+	return err ? 1 : 0;
+}
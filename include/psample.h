@@ -34,12 +34,19 @@
 #define __PSAMPLE_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <linux/types.h>
 #include <linux/psample.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct psample_config;
 struct psample_msg;
+struct psample_batch;
 
 struct psample_group {
 	int num;
@@ -55,7 +62,205 @@ enum psample_log_level {
 	PSAMPLE_LOG_NONE
 };
 
+/* Attribute bits of psample_set_fields() and the presence masks */
+#define PSAMPLE_FIELD(attr)		(1U << (attr))
+#define PSAMPLE_FIELD_IIF		PSAMPLE_FIELD(PSAMPLE_ATTR_IIFINDEX)
+#define PSAMPLE_FIELD_OIF		PSAMPLE_FIELD(PSAMPLE_ATTR_OIFINDEX)
+#define PSAMPLE_FIELD_ORIGSIZE		PSAMPLE_FIELD(PSAMPLE_ATTR_ORIGSIZE)
+#define PSAMPLE_FIELD_GROUP		PSAMPLE_FIELD(PSAMPLE_ATTR_SAMPLE_GROUP)
+#define PSAMPLE_FIELD_SEQ		PSAMPLE_FIELD(PSAMPLE_ATTR_GROUP_SEQ)
+#define PSAMPLE_FIELD_RATE		PSAMPLE_FIELD(PSAMPLE_ATTR_SAMPLE_RATE)
+#define PSAMPLE_FIELD_DATA		PSAMPLE_FIELD(PSAMPLE_ATTR_DATA)
+#define PSAMPLE_FIELD_TUNNEL		PSAMPLE_FIELD(PSAMPLE_ATTR_TUNNEL)
+#define PSAMPLE_FIELD_OUT_TC		PSAMPLE_FIELD(PSAMPLE_ATTR_OUT_TC)
+#define PSAMPLE_FIELD_OUT_TC_OCC	PSAMPLE_FIELD(PSAMPLE_ATTR_OUT_TC_OCC)
+#define PSAMPLE_FIELD_LATENCY		PSAMPLE_FIELD(PSAMPLE_ATTR_LATENCY)
+#define PSAMPLE_FIELD_TIMESTAMP		PSAMPLE_FIELD(PSAMPLE_ATTR_TIMESTAMP)
+#define PSAMPLE_FIELD_PROTO		PSAMPLE_FIELD(PSAMPLE_ATTR_PROTO)
+#define PSAMPLE_FIELD_ALL		(~0U)
+
+/* All attributes of a sample, see psample_msg_get(). present is a mask of the
+ * PSAMPLE_FIELD_* attributes carried; the others are zero.
+ */
+struct psample_msg_fields {
+	__u32 present;
+	__u32 group;
+	__u32 seq;
+	__u32 rate;
+	__u32 origsize;
+	__u16 iif;
+	__u16 oif;
+	__u16 out_tc;
+	__u16 proto;
+	__u64 out_tc_occ;
+	__u64 latency;
+	__u64 timestamp;
+	__u32 data_len;
+	const __u8 *data;
+	double keep;	/* the fraction the sample was accepted with */
+	__u64 tunnel_id;	/* see struct psample_tunnel_key */
+};
+
+static inline bool psample_fields_has(const struct psample_msg_fields *fields,
+				      __u32 field)
+{
+	return (fields->present & field) == field;
+}
+
+static inline __u32
+psample_fields_rate_effective(const struct psample_msg_fields *fields)
+{
+	double rate = fields->rate / fields->keep + 0.5;
+
+	return rate < UINT32_MAX ? rate : UINT32_MAX;
+}
+
+#define PSAMPLE_TUNNEL_FIELD(attr)	(1U << (attr))
+
+/* Tunnel metadata of a sample, see psample_msg_tunnel_get(). present is a
+ * mask of the PSAMPLE_TUNNEL_FIELD() bits of the psample_tunnel_key_attr
+ * attributes carried, which is all there is to the flag attributes. Addresses
+ * and options point into the message.
+ */
+struct psample_tunnel_key {
+	__u32 present;
+	__u64 id;		/* host order, the VNI for VXLAN and Geneve */
+	__u8 tos;
+	__u8 ttl;
+	__u16 tp_src;		/* host order */
+	__u16 tp_dst;		/* host order */
+	const __be32 *ipv4_src;
+	const __be32 *ipv4_dst;
+	const __u8 *ipv6_src;	/* 16 bytes */
+	const __u8 *ipv6_dst;	/* 16 bytes */
+	const void *geneve_opts;	/* struct geneve_opt array */
+	__u16 geneve_opts_len;
+	const void *vxlan_opts;		/* nested VXLAN_EXT_* attributes */
+	__u16 vxlan_opts_len;
+	const void *erspan_opts;	/* struct erspan_metadata */
+	__u16 erspan_opts_len;
+};
+
+static inline bool psample_tunnel_has(const struct psample_tunnel_key *key,
+				      int attr)
+{
+	return key->present & PSAMPLE_TUNNEL_FIELD(attr);
+}
+
+/* Flags of struct psample_flow_key */
+#define PSAMPLE_FLOW_VLAN	(1U << 0)	/* vlan is set */
+#define PSAMPLE_FLOW_IPV4	(1U << 1)	/* src and dst are set */
+#define PSAMPLE_FLOW_IPV6	(1U << 2)
+#define PSAMPLE_FLOW_PORTS	(1U << 3)	/* sport and dport are set */
+#define PSAMPLE_FLOW_TCP_FLAGS	(1U << 4)
+#define PSAMPLE_FLOW_FRAGMENT	(1U << 5)	/* no ports unless first */
+#define PSAMPLE_FLOW_TRUNCATED	(1U << 6)	/* stopped at the end of data */
+#define PSAMPLE_FLOW_QINQ	(1U << 7)	/* vlan_inner is set */
+
+/* Flow key and header offsets of an Ethernet packet, see psample_dissect().
+ * Offsets of the headers not reached are zero.
+ */
+struct psample_flow_key {
+	__u32 flags;
+	__u16 l3_off;
+	__u16 l4_off;
+	__u16 payload_off;
+	__u16 eth_proto;	/* host order, after the VLAN tags */
+	__u16 vlan;		/* ID of the outer tag */
+	__u16 vlan_inner;	/* ID of the second tag */
+	__u8 ip_proto;
+	__u8 dscp;
+	__u8 tcp_flags;
+	__u16 sport;		/* host order */
+	__u16 dport;		/* host order */
+	__u8 src[16];		/* IPv4 addresses use the first 4 bytes */
+	__u8 dst[16];
+};
+
+enum psample_encap {
+	PSAMPLE_ENCAP_NONE,
+	PSAMPLE_ENCAP_VXLAN,
+	PSAMPLE_ENCAP_GENEVE,
+	PSAMPLE_ENCAP_GRE,
+	PSAMPLE_ENCAP_NVGRE,
+	PSAMPLE_ENCAP_MPLS,
+	PSAMPLE_ENCAP_IPIP,	/* IPv4 or IPv6 in IPv4 or IPv6 */
+};
+
+/* Flow keys of an encapsulated packet, see psample_dissect_encap(). The
+ * offsets of both keys are from the start of the outer packet.
+ */
+struct psample_flow {
+	struct psample_flow_key outer;
+	struct psample_flow_key inner;	/* the outer key if not encapsulated */
+	unsigned int depth;		/* encapsulations followed */
+	enum psample_encap encap;	/* the innermost one followed */
+	__u32 vni;	/* VXLAN or Geneve VNI, NVGRE VSID or GRE key */
+	__u32 mpls_label;		/* outer label of the last MPLS stack */
+	__u8 mpls_labels;		/* depth of that stack */
+};
+
+#define PSAMPLE_MSG_BATCH_MAX 64
+
+/* Samples decoded into one array per attribute, see psample_dispatch_batch().
+ * Row i carries the attributes in present[i], a mask of PSAMPLE_FIELD_* bits;
+ * the columns of the others are zero. data[i] points into the receive buffer
+ * and is only valid during the callback.
+ */
+struct psample_msg_batch {
+	unsigned int count;
+	__u32 present[PSAMPLE_MSG_BATCH_MAX];
+	__u32 group[PSAMPLE_MSG_BATCH_MAX];
+	__u32 seq[PSAMPLE_MSG_BATCH_MAX];
+	__u32 rate[PSAMPLE_MSG_BATCH_MAX];
+	__u32 origsize[PSAMPLE_MSG_BATCH_MAX];
+	__u16 iif[PSAMPLE_MSG_BATCH_MAX];
+	__u16 oif[PSAMPLE_MSG_BATCH_MAX];
+	__u16 out_tc[PSAMPLE_MSG_BATCH_MAX];
+	__u16 proto[PSAMPLE_MSG_BATCH_MAX];
+	__u64 out_tc_occ[PSAMPLE_MSG_BATCH_MAX];
+	__u64 latency[PSAMPLE_MSG_BATCH_MAX];
+	__u64 timestamp[PSAMPLE_MSG_BATCH_MAX];
+	__u32 data_len[PSAMPLE_MSG_BATCH_MAX];
+	const __u8 *data[PSAMPLE_MSG_BATCH_MAX];
+	__u64 tunnel_id[PSAMPLE_MSG_BATCH_MAX];
+	double keep[PSAMPLE_MSG_BATCH_MAX];	/* see psample_msg_fields */
+};
+
+enum psample_recv_backend {
+	PSAMPLE_RECV_RECVMMSG,
+	PSAMPLE_RECV_IO_URING,	/* multishot recvmsg, falls back to recvmmsg */
+};
+
+/* Options for psample_open_ext(). A zeroed struct gives the defaults of
+ * psample_open().
+ */
+struct psample_open_opts {
+	unsigned int batch_size;	/* datagrams per receive syscall */
+	int rcvbuf;			/* socket receive buffer, in bytes */
+	bool rcvbuf_force;		/* use SO_RCVBUFFORCE (CAP_NET_ADMIN) */
+	bool no_enobufs;		/* don't report overruns as ENOBUFS */
+	enum psample_recv_backend recv_backend;
+	unsigned int uring_entries;	/* provided buffers, a power of two */
+	unsigned int shard_count;	/* see psample_open_shards() */
+	unsigned int shard_index;
+};
+
+/* Receive statistics of the sample socket. The average receive batch size is
+ * recv_msgs / recv_calls. overruns counts the ENOBUFS errors seen by the
+ * library, while drops is the number of messages the kernel could not queue
+ * to the socket, which is also maintained when no_enobufs is set.
+ */
+struct psample_stats {
+	__u64 recv_calls;
+	__u64 recv_msgs;
+	__u64 overruns;
+	__u64 drops;
+};
+
 typedef int (*psample_msg_cb)(const struct psample_msg *msg, void *data);
+typedef int (*psample_msg_batch_cb)(const struct psample_msg_batch *batch,
+				    void *data);
 typedef int (*psample_config_cb)(const struct psample_config *config,
 				 void *data);
 typedef int (*psample_group_cb)(const struct psample_group *group, void *data);
@@ -67,17 +272,175 @@ enum psample_log_level psample_get_log_level(void);
 void psample_set_log_func(logfn func);
 
 struct psample_handle *psample_open();
+struct psample_handle *psample_open_ext(const struct psample_open_opts *opts);
+
+/* Open count handles that split the samples between them. A socket filter on
+ * each handle accepts only the samples whose group sequence number modulo
+ * count is the handle index, and config notifications go to the first handle
+ * only. Each handle can then be dispatched from its own thread.
+ */
+int psample_open_shards(const struct psample_open_opts *opts,
+			unsigned int count, struct psample_handle **handles);
 void psample_close(struct psample_handle *handle);
 
 int psample_bind_group(struct psample_handle *handle, int group);
 
+/* Accept only the messages of the given groups, replacing any previous
+ * binding. The groups are matched by a binary search in one socket filter,
+ * which replaces the old filter atomically. Binding to no groups accepts all.
+ */
+int psample_bind_groups(struct psample_handle *handle, const int *groups,
+			unsigned int n);
+
+/* Have the kernel copy at most snaplen bytes of each sampled packet, or the
+ * whole packet if snaplen is negative. psample_msg_data_len() then returns
+ * the captured length and psample_msg_origsize() the original one.
+ * Attributes the kernel puts after the packet data, like
+ * PSAMPLE_ATTR_TUNNEL, are not received when the data is truncated.
+ */
+int psample_set_snaplen(struct psample_handle *handle, int snaplen);
+
+/* Have the kernel accept each sample with a probability of keep, in (0, 1],
+ * so that a consumer that falls behind loses samples uniformly rather than to
+ * socket overruns. The sample rates must then be scaled by 1 / keep, which
+ * psample_msg_rate_effective() does.
+ *
+ * psample_set_keep_auto() lets the library adjust the fraction, down to
+ * min_keep, from the socket drops and backlog seen during dispatch. A
+ * min_keep of zero turns it off.
+ *
+ * Samples still queued when the fraction changes were accepted with the old
+ * one. They are told apart by their group sequence number, requested right
+ * after the change, and each sample carries the fraction it was accepted with.
+ * Dispatch never waits for these numbers: until they are read, samples get
+ * the new fraction, and an automatic change waits for the previous one to be
+ * read.
+ */
+int psample_set_keep_fraction(struct psample_handle *handle, double keep);
+double psample_get_keep_fraction(struct psample_handle *handle);
+int psample_set_keep_auto(struct psample_handle *handle, double min_keep);
+
+/* Decode only the attributes in the PSAMPLE_FIELD_* mask fields for the
+ * samples passed to psample_msg_cb. The others are neither validated nor
+ * reported by the psample_msg_*_exist() functions, and decoding stops once all
+ * requested attributes are found. Config notifications are always fully
+ * decoded. The default is PSAMPLE_FIELD_ALL.
+ */
+int psample_set_fields(struct psample_handle *handle, __u32 fields);
+__u32 psample_get_fields(struct psample_handle *handle);
+
+int psample_set_batch_size(struct psample_handle *handle, unsigned int size);
+unsigned int psample_get_batch_size(struct psample_handle *handle);
+int psample_get_stats(struct psample_handle *handle,
+		      struct psample_stats *stats);
+
 int psample_dispatch(struct psample_handle *handle, psample_msg_cb msg_cb,
 		     void *msg_data, psample_config_cb config_cb,
 		     void *config_data, bool block);
 
+/* Handle the notifications of at most max_msgs pending datagrams without
+ * blocking and return the number of datagrams handled. The kernel sends each
+ * notification in a datagram of its own, so this is also the number of
+ * samples and config notifications handled. If a callback returns nonzero,
+ * the run stops after it and its value is stored in cb_ret, which is set to
+ * 0 otherwise and may be NULL. Meant to be called when the fd returned by
+ * psample_get_fd() is readable. The fd is left in blocking mode, as
+ * non-blocking receive is requested per call. With the io_uring receive
+ * backend, the returned fd is the ring fd.
+ */
+int psample_dispatch_budget(struct psample_handle *handle,
+			    unsigned int max_msgs, psample_msg_cb msg_cb,
+			    void *msg_data, psample_config_cb config_cb,
+			    void *config_data, int *cb_ret);
+
+/* Like psample_dispatch(), but on the netlink messages in the len bytes at
+ * buf, received elsewhere, e.g. replayed from an nlmon capture. Samples are
+ * decoded as with psample_set_fields(fields) and carry a keep fraction of 1.
+ */
+int psample_dispatch_buf(const void *buf, size_t len, __u32 fields,
+			 psample_msg_cb msg_cb, void *msg_data,
+			 psample_config_cb config_cb, void *config_data);
+
+/* Like psample_dispatch(), but the samples of each receive batch are decoded
+ * into a struct psample_msg_batch, and batch_cb is called once per batch of
+ * up to PSAMPLE_MSG_BATCH_MAX samples. Samples received before a config
+ * notification are passed to batch_cb before config_cb is called.
+ */
+int psample_dispatch_batch(struct psample_handle *handle,
+			   psample_msg_batch_cb batch_cb, void *batch_data,
+			   psample_config_cb config_cb, void *config_data,
+			   bool block);
+
+/* Pull-style alternative to the dispatch functions. psample_recv_batch()
+ * takes over the pending datagrams of the sample socket, receiving a new
+ * batch if there are none, and returns their number, 0 if none are pending
+ * and block is false. psample_batch_next() then returns the samples one by
+ * one, decoded in place like for psample_msg_cb, and NULL at the end of the
+ * batch. Config notifications are dropped, as are malformed messages: a
+ * consumer that needs them must use the dispatch functions with a
+ * config_cb. The samples are valid until the next receive on the handle.
+ */
+struct psample_batch *psample_batch_alloc(void);
+void psample_batch_free(struct psample_batch *batch);
+int psample_recv_batch(struct psample_handle *handle,
+		       struct psample_batch *batch, bool block);
+const struct psample_msg *psample_batch_next(struct psample_batch *batch);
+
+int psample_get_fd(struct psample_handle *handle);
+enum psample_recv_backend
+psample_get_recv_backend(struct psample_handle *handle);
+
 int psample_group_foreach(struct psample_handle *handle,
 			  psample_group_cb group_cb, void *data);
 
+/* A struct psample_msg points into the receive buffer and is only valid
+ * during psample_msg_cb. psample_msg_clone() copies it, with one copy of the
+ * message, into the psample_msg_clone_size() bytes at buf, which must be
+ * aligned like malloc() memory. The clone works with all psample_msg_*
+ * functions and is released by releasing buf. psample_msg_dup() clones into
+ * malloc() memory, to be released with psample_msg_free().
+ */
+size_t psample_msg_clone_size(const struct psample_msg *msg);
+struct psample_msg *psample_msg_clone(const struct psample_msg *msg,
+				      void *buf, size_t size);
+struct psample_msg *psample_msg_dup(const struct psample_msg *msg);
+void psample_msg_free(struct psample_msg *msg);
+
+/* Fill fields with all attributes of msg in one call. The inline
+ * psample_fields_*() helpers then work on the result without calling into
+ * the library.
+ */
+void psample_msg_get(const struct psample_msg *msg,
+		     struct psample_msg_fields *fields);
+
+/* Decode the PSAMPLE_ATTR_TUNNEL metadata of msg into key, on the first call
+ * only, the result is cached in msg. Returns -ENOENT if the sample carries
+ * none. Malformed attributes are left out of key->present.
+ */
+int psample_msg_tunnel_get(const struct psample_msg *msg,
+			   struct psample_tunnel_key *key);
+
+/* Dissect the Ethernet packet at data into key. Every header read is bounds
+ * checked, so a packet cut by the snaplen gives a partial key with
+ * PSAMPLE_FLOW_TRUNCATED set. Returns -EINVAL if len is shorter than an
+ * Ethernet header.
+ */
+int psample_dissect(const __u8 *data, __u32 len, struct psample_flow_key *key);
+
+/* Like psample_dissect(), but also follow up to depth encapsulations of
+ * VXLAN, Geneve, GRE, NVGRE, MPLS or IP in IP to the inner packet. Nothing
+ * is allocated.
+ */
+int psample_dissect_encap(const __u8 *data, __u32 len, unsigned int depth,
+			  struct psample_flow *flow);
+
+/* The flow key of the packet of msg, dissected on the first call and cached
+ * in msg, or NULL if msg carries no packet data.
+ */
+const struct psample_flow_key *psample_msg_flow(const struct psample_msg *msg);
+int psample_msg_flow_encap(const struct psample_msg *msg, unsigned int depth,
+			   struct psample_flow *flow);
+
 /**
  * psample_msg access functions
  */
@@ -93,9 +456,11 @@ bool psample_msg_out_tc_occ_exist(const struct psample_msg *msg);
 bool psample_msg_latency_exist(const struct psample_msg *msg);
 bool psample_msg_timestamp_exist(const struct psample_msg *msg);
 bool psample_msg_proto_exist(const struct psample_msg *msg);
+bool psample_msg_tunnel_exist(const struct psample_msg *msg);
 
 __u32 psample_msg_group(const struct psample_msg *msg);
 __u32 psample_msg_rate(const struct psample_msg *msg);
+__u32 psample_msg_rate_effective(const struct psample_msg *msg);
 __u16 psample_msg_iif(const struct psample_msg *msg);
 __u16 psample_msg_oif(const struct psample_msg *msg);
 __u32 psample_msg_origsize(const struct psample_msg *msg);
@@ -120,8 +485,110 @@ __u32 psample_config_group(const struct psample_config *config);
 __u32 psample_config_group_seq(const struct psample_config *config);
 __u32 psample_config_group_refcount(const struct psample_config *config);
 
+enum psample_pcap_flush {
+	PSAMPLE_PCAP_FLUSH_IMMEDIATE,	/* after every record, for pipes */
+	PSAMPLE_PCAP_FLUSH_BYTES,	/* once flush_bytes are pending */
+	PSAMPLE_PCAP_FLUSH_INTERVAL,	/* at most flush_ms after a record */
+	PSAMPLE_PCAP_FLUSH_FULL,	/* when the output buffer is full */
+};
+
+/* What the receiver does when the writer thread is behind */
+enum psample_pcap_ring_overflow {
+	PSAMPLE_PCAP_RING_BLOCK,	/* wait, the socket may overrun */
+	PSAMPLE_PCAP_RING_DROP,		/* keep draining the socket, drop */
+};
+
+/* How the file is written. URING_DIRECT bypasses the page cache: records are
+ * copied into io_depth + 1 aligned buffers of buf_size (0 for 1 MiB), written
+ * with O_DIRECT through io_uring with up to io_depth writes in flight, in a
+ * file whose blocks are allocated prealloc bytes at a time. A flush writes
+ * the last partial block padded, and rewrites it with what follows, so
+ * flushing every batch defeats the purpose. psample_pcap_fini() cuts the file
+ * to its length. The file can not be "-", and libpsample must be built with
+ * liburing.
+ */
+enum psample_pcap_io {
+	PSAMPLE_PCAP_IO_WRITEV,		/* through the page cache */
+	PSAMPLE_PCAP_IO_URING_DIRECT,	/* O_DIRECT, with io_uring */
+};
+
+enum psample_pcap_format {
+	PSAMPLE_PCAP_FORMAT_PCAP,	/* netlink messages, DLT_NETLINK */
+	PSAMPLE_PCAP_FORMAT_PCAPNG,	/* sampled packets with metadata */
+	PSAMPLE_PCAP_FORMAT_PACKETS,	/* sampled packets, DLT_EN10MB */
+};
+
+/* In pcapng files, each sample is an Enhanced Packet Block of the packet data,
+ * timestamped with PSAMPLE_ATTR_TIMESTAMP when the kernel provides it. The
+ * packet's interface, described by one Interface Description Block per
+ * group and input ifindex, has a resolution of a nanosecond. Each other
+ * attribute of the sample, except the tunnel, is a custom binary option
+ * (code 2989) of PSAMPLE_PCAPNG_PEN followed by the netlink attribute as
+ * received: type, length and payload, in host byte order.
+ */
+#define PSAMPLE_PCAPNG_PEN 33049	/* Mellanox Technologies */
+
+struct psample_pcap_opts {
+	enum psample_pcap_flush flush;
+	size_t flush_bytes;
+	unsigned int flush_ms;
+	size_t buf_size;		/* output buffer, 0 for 64 KiB */
+	enum psample_pcap_format format;
+	unsigned int ring_depth;	/* 0 to write from the receiver */
+	enum psample_pcap_ring_overflow ring_overflow;
+	enum psample_pcap_io io;
+	unsigned int io_depth;		/* URING_DIRECT, 0 for 4 */
+	size_t prealloc;		/* URING_DIRECT, 0 for 64 MiB */
+};
+
+/* Pipeline statistics, see ring_depth. The ring is full when it has
+ * ring_depth receive buffers that the writer thread has not written yet.
+ */
+struct psample_pcap_stats {
+	__u32 ring_depth;		/* rounded up to a power of two */
+	__u32 ring_used;
+	__u32 ring_max_used;
+	__u64 ring_stalls;		/* times the ring was found full */
+	__u64 ring_stall_usec;		/* waited for room, with BLOCK */
+	__u64 ring_drops;		/* datagrams dropped, with DROP */
+};
+
+/* Records are written straight from the receive buffers, with one writev()
+ * per receive batch. psample_pcap_init() writes every batch as it is
+ * received. With psample_pcap_init_opts(), batches are copied into the
+ * output buffer until the policy of opts flushes it. Intervals are checked
+ * at the end of each batch and, while no sample comes, by a timeout of the
+ * wait for the next one. psample_pcap_fini() flushes what is left. Records
+ * not timestamped by the kernel get the time their batch was received, also
+ * when the writer thread of a ring writes them later.
+ */
 int psample_pcap_init(const char *out_file, struct psample_handle *handle);
+
+/* Like psample_pcap_init(), but only the sampled packets are written, as
+ * Ethernet frames with their original length from PSAMPLE_ATTR_ORIGSIZE. The
+ * file has nanosecond timestamps, from PSAMPLE_ATTR_TIMESTAMP when the kernel
+ * provides it. Samples without packet data are not written.
+ */
+int psample_pcap_packets_init(const char *out_file,
+			      struct psample_handle *handle);
+int psample_pcap_init_opts(const char *out_file, struct psample_handle *handle,
+			   const struct psample_pcap_opts *opts);
 void psample_pcap_fini(struct psample_handle *handle);
+
+/* Receive and write until an error. With a ring_depth, a writer thread is
+ * started, and the calling thread only receives into the ring's buffers and
+ * hands them over, so that a slow disk does not hold up receiving.
+ */
 int psample_write_pcap_dispatch(struct psample_handle *handle);
 
+/* May be called while psample_write_pcap_dispatch() runs in another thread,
+ * the counters are then read as they are at that moment.
+ */
+int psample_pcap_get_stats(struct psample_handle *handle,
+			   struct psample_pcap_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __PSAMPLE_H__ */
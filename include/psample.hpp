@@ -0,0 +1,358 @@
+/*
+ *   psample.hpp	Header-only C++ wrapper of libpsample
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __PSAMPLE_HPP__
+#define __PSAMPLE_HPP__
+
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <psample.h>
+
+namespace psample {
+
+/* Field tags of fields<>. A sample of fields<F...> has one data member per
+ * tag, named after it, plus the present mask of PSAMPLE_FIELD_* bits.
+ */
+template <class F>
+struct field_member;
+
+#define PSAMPLE_HPP_FIELD(tag, type, bit, getter)			\
+	struct tag {							\
+		static constexpr __u32 mask = bit;			\
+	};								\
+	template <>							\
+	struct field_member<tag> {					\
+		type tag;						\
+		bool decode(const struct psample_msg *msg) noexcept	\
+		{							\
+			if (!psample_msg_##getter##_exist(msg))		\
+				return false;				\
+			tag = psample_msg_##getter(msg);		\
+			return true;					\
+		}							\
+	};
+
+PSAMPLE_HPP_FIELD(group, __u32, PSAMPLE_FIELD_GROUP, group)
+PSAMPLE_HPP_FIELD(seq, __u32, PSAMPLE_FIELD_SEQ, seq)
+PSAMPLE_HPP_FIELD(rate, __u32, PSAMPLE_FIELD_RATE, rate)
+PSAMPLE_HPP_FIELD(origsize, __u32, PSAMPLE_FIELD_ORIGSIZE, origsize)
+PSAMPLE_HPP_FIELD(iif, __u16, PSAMPLE_FIELD_IIF, iif)
+PSAMPLE_HPP_FIELD(oif, __u16, PSAMPLE_FIELD_OIF, oif)
+PSAMPLE_HPP_FIELD(out_tc, __u16, PSAMPLE_FIELD_OUT_TC, out_tc)
+PSAMPLE_HPP_FIELD(out_tc_occ, __u64, PSAMPLE_FIELD_OUT_TC_OCC, out_tc_occ)
+PSAMPLE_HPP_FIELD(latency, __u64, PSAMPLE_FIELD_LATENCY, latency)
+PSAMPLE_HPP_FIELD(timestamp, __u64, PSAMPLE_FIELD_TIMESTAMP, timestamp)
+PSAMPLE_HPP_FIELD(proto, __u16, PSAMPLE_FIELD_PROTO, proto)
+
+#undef PSAMPLE_HPP_FIELD
+
+/* The packet, data_len bytes of it at data, valid during the handler */
+struct data {
+	static constexpr __u32 mask = PSAMPLE_FIELD_DATA;
+};
+
+template <>
+struct field_member<data> {
+	const __u8 *data;
+	__u32 data_len;
+	bool decode(const struct psample_msg *msg) noexcept
+	{
+		if (!psample_msg_data_exist(msg))
+			return false;
+		data = psample_msg_data(msg);
+		data_len = psample_msg_data_len(msg);
+		return true;
+	}
+};
+
+struct tunnel {
+	static constexpr __u32 mask = PSAMPLE_FIELD_TUNNEL;
+};
+
+template <>
+struct field_member<tunnel> {
+	struct psample_tunnel_key tunnel;
+	bool decode(const struct psample_msg *msg) noexcept
+	{
+		return !psample_msg_tunnel_get(msg, &tunnel);
+	}
+};
+
+template <class... F>
+struct fields {
+	static constexpr __u32 mask = (F::mask | ... | 0U);
+
+	template <class T>
+	static constexpr bool has = ((T::mask & mask) != 0);
+};
+
+template <class... F>
+struct sample : field_member<F>... {
+	__u32 present;
+};
+
+/* Owns a struct psample_batch. Iterating it yields the samples received by
+ * session::recv() as const struct psample_msg pointers, see
+ * psample_batch_next().
+ */
+class batch {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = const struct psample_msg *;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const value_type *;
+		using reference = value_type;
+
+		iterator() noexcept = default;
+
+		explicit iterator(struct psample_batch *b) noexcept
+			: batch_(b), msg_(psample_batch_next(b))
+		{
+		}
+
+		reference operator*() const noexcept
+		{
+			return msg_;
+		}
+
+		iterator &operator++() noexcept
+		{
+			msg_ = psample_batch_next(batch_);
+			return *this;
+		}
+
+		void operator++(int) noexcept
+		{
+			++*this;
+		}
+
+		bool operator==(const iterator &other) const noexcept
+		{
+			return msg_ == other.msg_;
+		}
+
+		bool operator!=(const iterator &other) const noexcept
+		{
+			return msg_ != other.msg_;
+		}
+
+	private:
+		struct psample_batch *batch_ = nullptr;
+		const struct psample_msg *msg_ = nullptr;
+	};
+
+	batch() : batch_(psample_batch_alloc())
+	{
+		if (!batch_)
+			throw std::bad_alloc();
+	}
+
+	batch(const batch &) = delete;
+	batch &operator=(const batch &) = delete;
+
+	~batch()
+	{
+		psample_batch_free(batch_);
+	}
+
+	iterator begin() noexcept
+	{
+		return iterator(batch_);
+	}
+
+	iterator end() noexcept
+	{
+		return iterator();
+	}
+
+	struct psample_batch *get() const noexcept
+	{
+		return batch_;
+	}
+
+private:
+	struct psample_batch *batch_;
+};
+
+template <class Fields>
+class session;
+
+/* Owns a psample handle set up to decode only the fields F, and to have the
+ * kernel trim the packet data when it is not one of them. Handlers get a
+ * sample<F...> by value and may return void, or an int that stops the
+ * dispatch when nonzero, like psample_msg_cb.
+ */
+template <class... F>
+class session<fields<F...>> {
+public:
+	using fields_type = fields<F...>;
+	using sample_type = sample<F...>;
+
+	explicit session(const struct psample_open_opts *opts = nullptr)
+	{
+		int err;
+
+		handle_ = psample_open_ext(opts);
+		if (!handle_)
+			throw std::system_error(errno ? errno : EIO,
+						std::system_category(),
+						"psample_open_ext");
+
+		err = psample_set_fields(handle_, fields_type::mask);
+		/* The tunnel attribute follows the data, keep both then */
+		if (!err && !fields_type::template has<data> &&
+		    !fields_type::template has<tunnel>)
+			err = psample_set_snaplen(handle_, 0);
+		if (err) {
+			psample_close(handle_);
+			throw std::system_error(-err, std::system_category(),
+						"psample session setup");
+		}
+	}
+
+	session(const session &) = delete;
+	session &operator=(const session &) = delete;
+
+	session(session &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	session &operator=(session &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~session()
+	{
+		reset();
+	}
+
+	static void decode(const struct psample_msg *msg,
+			   sample_type &s) noexcept
+	{
+		s.present = 0;
+		((static_cast<field_member<F> &>(s).decode(msg) ?
+		  s.present |= F::mask : 0), ...);
+	}
+
+	static sample_type decode(const struct psample_msg *msg) noexcept
+	{
+		sample_type s{};
+
+		decode(msg, s);
+		return s;
+	}
+
+	/* Receive into b, which is then iterated with decode():
+	 *	for (auto msg : b)
+	 *		use(decode(msg));
+	 */
+	int recv(batch &b, bool block = true) noexcept
+	{
+		return psample_recv_batch(handle_, b.get(), block);
+	}
+
+	template <class Handler>
+	int dispatch(Handler &&handler, bool block = true) noexcept
+	{
+		return psample_dispatch(handle_, msg_cb<Handler>,
+					handler_ptr(handler), nullptr,
+					nullptr, block);
+	}
+
+	template <class Handler>
+	int dispatch_budget(unsigned int max_msgs, Handler &&handler,
+			    int *cb_ret = nullptr) noexcept
+	{
+		return psample_dispatch_budget(handle_, max_msgs,
+					       msg_cb<Handler>,
+					       handler_ptr(handler),
+					       nullptr, nullptr, cb_ret);
+	}
+
+	int bind_groups(const std::vector<int> &groups) noexcept
+	{
+		return psample_bind_groups(handle_, groups.data(),
+					   groups.size());
+	}
+
+	int set_snaplen(int snaplen) noexcept
+	{
+		return psample_set_snaplen(handle_, snaplen);
+	}
+
+	int fd() const noexcept
+	{
+		return psample_get_fd(handle_);
+	}
+
+	struct psample_handle *get() const noexcept
+	{
+		return handle_;
+	}
+
+	struct psample_handle *release() noexcept
+	{
+		return std::exchange(handle_, nullptr);
+	}
+
+private:
+	/* const handlers are only ever called through a const pointer again */
+	template <class Handler>
+	static void *handler_ptr(Handler &handler) noexcept
+	{
+		return const_cast<void *>(
+			static_cast<const void *>(std::addressof(handler)));
+	}
+
+	template <class Handler>
+	static int msg_cb(const struct psample_msg *msg, void *data) noexcept
+	{
+		auto &handler = *static_cast<std::remove_reference_t<Handler> *>(
+			data);
+		sample_type s{};
+
+		decode(msg, s);
+		if constexpr (std::is_void_v<std::invoke_result_t<
+				      decltype(handler), sample_type>>) {
+			handler(s);
+			return 0;
+		} else {
+			return handler(s);
+		}
+	}
+
+	void reset() noexcept
+	{
+		if (handle_)
+			psample_close(handle_);
+		handle_ = nullptr;
+	}
+
+	struct psample_handle *handle_;
+};
+
+} /* namespace psample */
+
+#endif /* __PSAMPLE_HPP__ */
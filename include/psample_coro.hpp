@@ -0,0 +1,443 @@
+/*
+ *   psample_coro.hpp	C++20 coroutine sample streams on top of psample.hpp
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __PSAMPLE_CORO_HPP__
+#define __PSAMPLE_CORO_HPP__
+
+#if __cplusplus < 202002L
+#error "psample_coro.hpp requires C++20"
+#endif
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <span>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <psample.hpp>
+
+namespace psample {
+
+class executor;
+
+template <class Fields>
+class stream;
+
+/* A coroutine started by executor::spawn(). It runs until its first
+ * suspension within spawn() and frees itself when it returns.
+ */
+class task {
+public:
+	struct promise_type {
+		task get_return_object() noexcept
+		{
+			return task(std::coroutine_handle<promise_type>::
+					    from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	task(task &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	~task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+private:
+	friend class executor;
+
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept
+		: handle_(handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+/* Single-threaded executor resuming coroutines waiting for readable fds. It
+ * can run on its own with run(), or from an external event loop: fd() is an
+ * epoll fd that is readable when run_once(0) has coroutines to resume.
+ */
+class executor {
+public:
+	executor()
+	{
+		epfd_ = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd_ < 0)
+			throw std::system_error(errno, std::system_category(),
+						"epoll_create1");
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	~executor()
+	{
+		close(epfd_);
+	}
+
+	int fd() const noexcept
+	{
+		return epfd_;
+	}
+
+	void spawn(task t) noexcept
+	{
+		std::exchange(t.handle_, nullptr).resume();
+	}
+
+	/* Wait up to timeout_ms for readable fds and resume their coroutines.
+	 * Returns the number resumed, or -errno.
+	 */
+	int run_once(int timeout_ms) noexcept
+	{
+		void *address;
+		int n = 0;
+
+		nevents_ = epoll_wait(epfd_, events_, 16, timeout_ms);
+		if (nevents_ < 0) {
+			nevents_ = 0;
+			return errno == EINTR ? 0 : -errno;
+		}
+
+		for (next_ = 0; next_ < nevents_;) {
+			/* NULL if its coroutine was destroyed meanwhile */
+			address = events_[next_++].data.ptr;
+			if (!address)
+				continue;
+			waiting_--;
+			n++;
+			std::coroutine_handle<>::from_address(address).resume();
+		}
+		nevents_ = 0;
+		return n;
+	}
+
+	/* Run until no coroutine is waiting or stop() is called */
+	int run() noexcept
+	{
+		int err = 0;
+
+		stopped_ = false;
+		while (waiting_ && !stopped_ && err >= 0)
+			err = run_once(-1);
+		return err < 0 ? err : 0;
+	}
+
+	void stop() noexcept
+	{
+		stopped_ = true;
+	}
+
+	/* Awaitable suspending the coroutine until fd is readable */
+	auto readable(int fd) noexcept
+	{
+		struct awaiter {
+			executor &ex;
+			int fd;
+			int err;
+			std::coroutine_handle<> waiter;
+
+			bool await_ready() const noexcept { return false; }
+
+			bool await_suspend(std::coroutine_handle<> h) noexcept
+			{
+				err = ex.arm(fd, h);
+				if (!err)
+					waiter = h;
+				return !err;
+			}
+
+			/* 0, or -errno if the fd could not be watched */
+			int await_resume() noexcept
+			{
+				waiter = nullptr;
+				return err;
+			}
+
+			/* The coroutine was destroyed while suspended */
+			~awaiter()
+			{
+				if (waiter)
+					ex.disarm(fd, waiter);
+			}
+		};
+
+		return awaiter{*this, fd, 0, nullptr};
+	}
+
+private:
+	template <class Fields>
+	friend class stream;
+
+	/* One-shot, so that an fd is reported once per wait. The fd stays in
+	 * the set afterwards and is re-armed by the next wait.
+	 */
+	int arm(int fd, std::coroutine_handle<> h) noexcept
+	{
+		struct epoll_event event = {};
+
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = h.address();
+		if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event) &&
+		    (errno != ENOENT ||
+		     epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event)))
+			return -errno;
+
+		waiting_++;
+		return 0;
+	}
+
+	/* Forget the wait of h, whose frame is going away, so that no event
+	 * points at it anymore.
+	 */
+	void disarm(int fd, std::coroutine_handle<> h) noexcept
+	{
+		struct epoll_event event = {};
+		int i;
+
+		epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, &event);
+		waiting_--;
+		for (i = next_; i < nevents_; i++)
+			if (events_[i].data.ptr == h.address())
+				events_[i].data.ptr = nullptr;
+	}
+
+	int epfd_;
+	unsigned int waiting_ = 0;
+	bool stopped_ = false;
+	/* The events run_once() is going through */
+	struct epoll_event events_[16];
+	int nevents_ = 0;
+	int next_ = 0;
+};
+
+/* Stream of decoded samples of a session<Fields>. co_await next_batch()
+ * returns the samples pending on the socket, suspending on the executor
+ * until there are some. The returned samples are valid until the next call.
+ * When the packet data or the tunnel is one of the fields, the bytes they
+ * point to are copied into the stream, since the receive buffers are reused
+ * while the batch is collected.
+ */
+template <class Fields>
+class stream {
+public:
+	using session_type = session<Fields>;
+	using sample_type = typename session_type::sample_type;
+
+	explicit stream(executor &ex,
+			const struct psample_open_opts *opts = nullptr)
+		: ex_(ex), session_(opts)
+	{
+	}
+
+	session_type &get_session() noexcept
+	{
+		return session_;
+	}
+
+	/* The error of the last receive, as -errno, or 0 */
+	int error() const noexcept
+	{
+		return error_;
+	}
+
+	/* Awaitable returning a std::span<const sample_type> of at most
+	 * max_msgs samples, psample_get_batch_size() ones if zero. The span
+	 * is empty on error, see error(), and may be empty after a spurious
+	 * wakeup.
+	 */
+	auto next_batch(unsigned int max_msgs = 0) noexcept
+	{
+		struct awaiter {
+			stream &s;
+			unsigned int max_msgs;
+
+			bool await_ready() noexcept
+			{
+				return s.fill(max_msgs) != 0;
+			}
+
+			bool await_suspend(std::coroutine_handle<> h) noexcept
+			{
+				return !s.wait(h);
+			}
+
+			std::span<const sample_type> await_resume() noexcept
+			{
+				if (s.waiter_) {
+					s.waiter_ = nullptr;
+					s.fill(max_msgs);
+				}
+				return s.batch_;
+			}
+
+			/* The coroutine was destroyed while suspended */
+			~awaiter()
+			{
+				if (s.waiter_) {
+					s.ex_.disarm(s.session_.fd(), s.waiter_);
+					s.waiter_ = nullptr;
+				}
+			}
+		};
+
+		return awaiter{*this, max_msgs};
+	}
+
+private:
+	/* Collect pending samples, returns their number or -errno */
+	int fill(unsigned int max_msgs) noexcept
+	{
+		int n;
+
+		batch_.clear();
+		data_.clear();
+		data_off_.clear();
+		tunnel_off_.clear();
+		error_ = 0;
+		if (!max_msgs)
+			max_msgs = psample_get_batch_size(session_.get());
+
+		n = session_.dispatch_budget(max_msgs,
+					     [this](const sample_type &s) {
+						     return collect(s);
+					     });
+		if (n < 0) {
+			error_ = n;
+			batch_.clear();
+			return n;
+		}
+
+		if constexpr (Fields::template has<data>) {
+			for (size_t i = 0; i < batch_.size(); i++)
+				if (batch_[i].present & data::mask)
+					batch_[i].data =
+						data_.data() + data_off_[i];
+		}
+		if constexpr (Fields::template has<tunnel>) {
+			for (size_t i = 0; i < batch_.size(); i++)
+				if (batch_[i].present & tunnel::mask)
+					tunnel_rebase(batch_[i].tunnel,
+						      tunnel_off_[i]);
+		}
+		return batch_.size();
+	}
+
+	/* Calls f(pointer, length) on each byte range the key points to */
+	template <class Key, class F>
+	static void tunnel_ranges(Key &key, F &&f)
+	{
+		if (key.ipv4_src)
+			f(key.ipv4_src, sizeof(*key.ipv4_src));
+		if (key.ipv4_dst)
+			f(key.ipv4_dst, sizeof(*key.ipv4_dst));
+		if (key.ipv6_src)
+			f(key.ipv6_src, 16);
+		if (key.ipv6_dst)
+			f(key.ipv6_dst, 16);
+		if (key.geneve_opts)
+			f(key.geneve_opts, key.geneve_opts_len);
+		if (key.vxlan_opts)
+			f(key.vxlan_opts, key.vxlan_opts_len);
+		if (key.erspan_opts)
+			f(key.erspan_opts, key.erspan_opts_len);
+	}
+
+	/* Netlink attributes are 4 byte aligned, keep the copies so */
+	static size_t tunnel_align(size_t off) noexcept
+	{
+		return (off + 3) & ~static_cast<size_t>(3);
+	}
+
+	/* Append the byte ranges of key to data_, may throw */
+	void tunnel_copy(const struct psample_tunnel_key &key)
+	{
+		tunnel_ranges(key, [this](const void *p, size_t len) {
+			const __u8 *b = static_cast<const __u8 *>(p);
+
+			data_.resize(tunnel_align(data_.size()));
+			data_.insert(data_.end(), b, b + len);
+		});
+	}
+
+	/* Point key to the copies tunnel_copy() made at off */
+	void tunnel_rebase(struct psample_tunnel_key &key, size_t off) noexcept
+	{
+		tunnel_ranges(key, [&](auto &p, size_t len) {
+			using ptr = std::remove_reference_t<decltype(p)>;
+
+			off = tunnel_align(off);
+			p = reinterpret_cast<ptr>(data_.data() + off);
+			off += len;
+		});
+	}
+
+	int collect(const sample_type &s) noexcept
+	{
+		/* On allocation failure, end the batch with what fits */
+		try {
+			if constexpr (Fields::template has<data>) {
+				data_off_.push_back(data_.size());
+				if (s.present & data::mask)
+					data_.insert(data_.end(), s.data,
+						     s.data + s.data_len);
+			}
+			if constexpr (Fields::template has<tunnel>) {
+				tunnel_off_.push_back(data_.size());
+				if (s.present & tunnel::mask)
+					tunnel_copy(s.tunnel);
+			}
+			batch_.push_back(s);
+		} catch (const std::bad_alloc &) {
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Returns nonzero if the coroutine was not suspended */
+	int wait(std::coroutine_handle<> h) noexcept
+	{
+		error_ = ex_.arm(session_.fd(), h);
+		if (!error_)
+			waiter_ = h;
+		return error_;
+	}
+
+	executor &ex_;
+	session_type session_;
+	std::vector<sample_type> batch_;
+	std::vector<__u8> data_;
+	std::vector<size_t> data_off_;
+	std::vector<size_t> tunnel_off_;
+	int error_ = 0;
+	std::coroutine_handle<> waiter_;	/* suspended in next_batch() */
+};
+
+} /* namespace psample */
+
+#endif /* __PSAMPLE_CORO_HPP__ */
@@ -37,6 +37,7 @@
 #include <time.h>
 #include <string.h>
 #include <inttypes.h>
+#include <arpa/inet.h>
 
 #define min(a, b) (((a) > (b)) ? (b) : (a))
 #define DIV_ROUND_UP(a, b) (((a) + (b) - 1) / (b))
@@ -47,7 +48,7 @@ static char printable(char c)
 	return isprint((int) c) ? c : '.';
 }
 
-static void hexdump_buf(__u8 *msg, int len)
+static void hexdump_buf(const __u8 *msg, int len)
 {
 	int index;
 	int line;
@@ -91,51 +92,78 @@ static int show_group_cb(const struct psample_group *group, void *data)
 	return 0;
 }
 
+static void show_tunnel(const struct psample_msg *msg)
+{
+	struct psample_tunnel_key key;
+	char addr[INET6_ADDRSTRLEN];
+
+	if (psample_msg_tunnel_get(msg, &key))
+		return;
+
+	if (psample_tunnel_has(&key, PSAMPLE_TUNNEL_KEY_ATTR_ID))
+		printf("tunnel-id %llu ", key.id);
+	if (key.ipv4_src &&
+	    inet_ntop(AF_INET, key.ipv4_src, addr, sizeof(addr)))
+		printf("tunnel-src %s ", addr);
+	if (key.ipv4_dst &&
+	    inet_ntop(AF_INET, key.ipv4_dst, addr, sizeof(addr)))
+		printf("tunnel-dst %s ", addr);
+	if (key.ipv6_src &&
+	    inet_ntop(AF_INET6, key.ipv6_src, addr, sizeof(addr)))
+		printf("tunnel-src %s ", addr);
+	if (key.ipv6_dst &&
+	    inet_ntop(AF_INET6, key.ipv6_dst, addr, sizeof(addr)))
+		printf("tunnel-dst %s ", addr);
+	if (psample_tunnel_has(&key, PSAMPLE_TUNNEL_KEY_ATTR_TP_DST))
+		printf("tunnel-dport %u ", key.tp_dst);
+}
+
 static int show_message_cb(const struct psample_msg *msg, void *data)
 {
 	bool verbose = *(bool *) data;
-
-	if (psample_msg_group_exist(msg))
-		printf("group %d ", psample_msg_group(msg));
-	if (psample_msg_iif_exist(msg))
-		printf("in-ifindex %d ", psample_msg_iif(msg));
-	if (psample_msg_oif_exist(msg))
-		printf("out-ifindex %d ", psample_msg_oif(msg));
-	if (psample_msg_origsize_exist(msg))
-		printf("origsize %d ", psample_msg_origsize(msg));
-	if (psample_msg_rate_exist(msg))
-		printf("sample-rate %d ", psample_msg_rate(msg));
-	if (psample_msg_seq_exist(msg))
-		printf("seq %d ", psample_msg_seq(msg));
-	if (psample_msg_out_tc_exist(msg))
-		printf("out-tc %u ", psample_msg_out_tc(msg));
-	if (psample_msg_out_tc_occ_exist(msg))
-		printf("out-tc-occ %llu ", psample_msg_out_tc_occ(msg));
-	if (psample_msg_latency_exist(msg))
-		printf("latency %llu ", psample_msg_latency(msg));
-	if (psample_msg_timestamp_exist(msg)) {
+	struct psample_msg_fields f;
+
+	psample_msg_get(msg, &f);
+
+	if (psample_fields_has(&f, PSAMPLE_FIELD_GROUP))
+		printf("group %d ", f.group);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_IIF))
+		printf("in-ifindex %d ", f.iif);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_OIF))
+		printf("out-ifindex %d ", f.oif);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_ORIGSIZE))
+		printf("origsize %d ", f.origsize);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_RATE))
+		printf("sample-rate %d ", f.rate);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_SEQ))
+		printf("seq %d ", f.seq);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_OUT_TC))
+		printf("out-tc %u ", f.out_tc);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_OUT_TC_OCC))
+		printf("out-tc-occ %llu ", f.out_tc_occ);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_LATENCY))
+		printf("latency %llu ", f.latency);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_TIMESTAMP)) {
 		time_t tv_sec;
 		struct tm *tm;
 		char *tstr;
-		__u64 ts;
 
-		ts = psample_msg_timestamp(msg);
-		tv_sec = ts / 1000000000;
+		tv_sec = f.timestamp / 1000000000;
 		tm = localtime(&tv_sec);
 
 		tstr = asctime(tm);
 		tstr[strlen(tstr) - 1] = 0;
 		printf("timestamp %s %09" PRId64 " nsec ", tstr,
-		       ts % 1000000000);
+		       f.timestamp % 1000000000);
 	}
-	if (psample_msg_proto_exist(msg))
-		printf("protocol 0x%x ", psample_msg_proto(msg));
-
-	if (verbose && psample_msg_data_exist(msg)) {
-		int data_len = psample_msg_data_len(msg);
-
-		printf("data len %d\n", data_len);
-		hexdump_buf(psample_msg_data(msg), data_len);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_PROTO))
+		printf("protocol 0x%x ", f.proto);
+	if (psample_fields_has(&f, PSAMPLE_FIELD_TUNNEL))
+		show_tunnel(msg);
+
+	if (verbose && psample_fields_has(&f, PSAMPLE_FIELD_DATA)) {
+		printf("data len %d\n", f.data_len);
+		hexdump_buf(f.data, f.data_len);
 	}
 
 	printf("\n");
@@ -181,19 +209,43 @@ static struct argp_option options[] = {
 			"when monitoring, don't show config notifications" },
 	{"no-sample", 's', 0, 0,
 			"when monitoring, don't show sample notifications" },
-	{"group", 'g', "GROUP_NUM", 0, "for monitor, filter by group" },
+	{"group", 'g', "GROUP_NUM", 0,
+			"for monitor, filter by group (may be repeated)" },
 	{"verbose", 'v', 0, 0, "print the packet data" },
 	{"write", 'w', "OUT_FILE", 0, "write sampled packets to file" },
+	{"write-packets", 'p', "OUT_FILE", 0,
+			"write only the sampled frames to file, as Ethernet" },
+	{"ring", 'r', "DEPTH", 0,
+			"with write, write from a thread fed DEPTH buffers" },
+	{"ring-drop", 'd', 0, 0,
+			"with ring, drop rather than wait when it is full" },
+	{"pcapng", 'n', 0, 0,
+			"with write, write pcapng with the sample metadata, "
+			"not with write-packets" },
+	{"direct", 'D', 0, 0,
+			"with write, write with O_DIRECT through io_uring" },
+	{"batch", 'b', "SIZE", 0,
+			"receive up to SIZE packets with a single syscall" },
+	{"io-uring", 'u', 0, 0,
+			"receive packets with io_uring when supported" },
 	{ 0 }
 };
 
 struct psample_tool_options {
 	enum command cmd;
-	int group;
+	int *groups;
+	unsigned int ngroups;
 	bool verbose;
 	bool no_config;
 	bool no_sample;
 	const char *out_file;
+	unsigned int batch;
+	bool io_uring;
+	bool pcapng;
+	bool packets;
+	unsigned int ring_depth;
+	bool ring_drop;
+	bool direct;
 };
 
 static const char *cmd_str_get(enum command cmd)
@@ -256,7 +308,14 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		break;
 	case 'g':
 		forbid_cmd(arguments->cmd, COMMAND_WRITE, "group", state);
-		arguments->group = atoi(arg);
+		arguments->groups = realloc(arguments->groups,
+					    (arguments->ngroups + 1) *
+					    sizeof(*arguments->groups));
+		if (!arguments->groups) {
+			printf("Could not allocate memory\n");
+			exit(1);
+		}
+		arguments->groups[arguments->ngroups++] = atoi(arg);
 		break;
 	case 'c':
 		forbid_cmd(arguments->cmd, COMMAND_LIST_GROUPS, "no-config",
@@ -278,6 +337,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		}
 		arguments->no_sample = true;
 		break;
+	case 'p':
+		arguments->packets = true;
+		if (arguments->pcapng) {
+			printf("Cant put both pcapng and write-packets\n");
+			argp_usage(state);
+		}
+		/* fall through */
 	case 'w':
 		arguments->cmd = COMMAND_WRITE;
 		arguments->out_file = arg;
@@ -287,11 +353,41 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 				arguments->cmd, state);
 		forbid_argument(arguments->verbose, "verbose", arguments->cmd,
 				state);
-		if (arguments->group >= 0) {
+		if (arguments->ngroups) {
 			printf("Cant put both group and write\n");
 			argp_usage(state);
 		}
 		break;
+	case 'b':
+		arguments->batch = atoi(arg);
+		if (!arguments->batch) {
+			printf("Batch size must be positive\n");
+			argp_usage(state);
+		}
+		break;
+	case 'u':
+		arguments->io_uring = true;
+		break;
+	case 'n':
+		arguments->pcapng = true;
+		if (arguments->packets) {
+			printf("Cant put both pcapng and write-packets\n");
+			argp_usage(state);
+		}
+		break;
+	case 'r':
+		arguments->ring_depth = atoi(arg);
+		if (!arguments->ring_depth) {
+			printf("Ring depth must be positive\n");
+			argp_usage(state);
+		}
+		break;
+	case 'd':
+		arguments->ring_drop = true;
+		break;
+	case 'D':
+		arguments->direct = true;
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -305,25 +401,35 @@ static struct argp argp = { options, parse_opt, NULL, doc };
 int main(int argc, char **argv)
 {
 	struct psample_tool_options arguments = {0};
+	struct psample_open_opts opts = {0};
+	struct psample_pcap_opts pcap_opts = {0};
 	struct psample_handle *handle;
 	bool first_run = true;
 	int err = 0;
 
 	arguments.cmd = COMMAND_MONITOR;
-	arguments.group = -1;
 	arguments.out_file = NULL;
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
 	psample_set_log_level(PSAMPLE_LOG_INFO);
 
-	handle = psample_open();
+	opts.batch_size = arguments.batch;
+	if (arguments.io_uring)
+		opts.recv_backend = PSAMPLE_RECV_IO_URING;
+
+	handle = psample_open_ext(&opts);
 	if (!handle)
 		return -1;
 
 	switch (arguments.cmd) {
 	case COMMAND_MONITOR:
-		if (arguments.group != -1)
-			psample_bind_group(handle, arguments.group);
+		if (arguments.ngroups)
+			psample_bind_groups(handle, arguments.groups,
+					    arguments.ngroups);
+
+		/* The packet data is only printed in verbose mode */
+		if (!arguments.verbose)
+			psample_set_snaplen(handle, 0);
 
 		if (arguments.no_sample)
 			psample_dispatch(handle, NULL, NULL, show_config_cb,
@@ -340,7 +446,27 @@ int main(int argc, char **argv)
 		psample_group_foreach(handle, show_group_cb, &first_run);
 		break;
 	case COMMAND_WRITE:
-		err = psample_pcap_init(arguments.out_file, handle);
+		/* Pipes get every packet as it comes, files are written in
+		 * large blocks, at least once a second.
+		 */
+		if (!strcmp(arguments.out_file, "-")) {
+			pcap_opts.flush = PSAMPLE_PCAP_FLUSH_IMMEDIATE;
+		} else {
+			pcap_opts.flush = PSAMPLE_PCAP_FLUSH_INTERVAL;
+			pcap_opts.flush_ms = 1000;
+			pcap_opts.buf_size = 1 << 20;
+		}
+		if (arguments.pcapng)
+			pcap_opts.format = PSAMPLE_PCAP_FORMAT_PCAPNG;
+		else if (arguments.packets)
+			pcap_opts.format = PSAMPLE_PCAP_FORMAT_PACKETS;
+		pcap_opts.ring_depth = arguments.ring_depth;
+		if (arguments.ring_drop)
+			pcap_opts.ring_overflow = PSAMPLE_PCAP_RING_DROP;
+		if (arguments.direct)
+			pcap_opts.io = PSAMPLE_PCAP_IO_URING_DIRECT;
+		err = psample_pcap_init_opts(arguments.out_file, handle,
+					     &pcap_opts);
 		if (err)
 			break;
 
@@ -350,6 +476,7 @@ int main(int argc, char **argv)
 	}
 
 	psample_close(handle);
+	free(arguments.groups);
 
 	return err;
 }
@@ -0,0 +1,424 @@
+/*
+ *   dissect.c	Flow keys of the packets carried by psample samples
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <psample.h>
+
+#define DISSECT_ETH_HLEN	14
+#define DISSECT_VLAN_HLEN	4
+#define DISSECT_IPV4_HLEN	20
+#define DISSECT_IPV6_HLEN	40
+#define DISSECT_TCP_HLEN	20
+#define DISSECT_IPV6_EXT_MAX	8
+#define DISSECT_VLAN_MAX	8
+#define DISSECT_MPLS_MAX	8
+#define DISSECT_VXLAN_HLEN	8
+#define DISSECT_GENEVE_HLEN	8
+#define DISSECT_GRE_HLEN	4
+
+#define DISSECT_ETH_P_IP	0x0800
+#define DISSECT_ETH_P_8021Q	0x8100
+#define DISSECT_ETH_P_8021AD	0x88a8
+#define DISSECT_ETH_P_QINQ1	0x9100
+#define DISSECT_ETH_P_IPV6	0x86dd
+#define DISSECT_ETH_P_TEB	0x6558	/* Ethernet in GRE and Geneve */
+#define DISSECT_ETH_P_MPLS_UC	0x8847
+#define DISSECT_ETH_P_MPLS_MC	0x8848
+
+#define DISSECT_IPPROTO_HOPOPTS		0
+#define DISSECT_IPPROTO_IPIP		4
+#define DISSECT_IPPROTO_TCP		6
+#define DISSECT_IPPROTO_UDP		17
+#define DISSECT_IPPROTO_IPV6		41
+#define DISSECT_IPPROTO_ROUTING		43
+#define DISSECT_IPPROTO_FRAGMENT	44
+#define DISSECT_IPPROTO_GRE		47
+#define DISSECT_IPPROTO_AH		51
+#define DISSECT_IPPROTO_DSTOPTS		60
+#define DISSECT_IPPROTO_SCTP		132
+#define DISSECT_IPPROTO_UDPLITE		136
+
+#define DISSECT_PORT_VXLAN	4789
+#define DISSECT_PORT_GENEVE	6081
+
+/* The packet being dissected. Every read is checked against len, and a
+ * packet too short for a header stops the dissection with
+ * PSAMPLE_FLOW_TRUNCATED set.
+ */
+struct dissect {
+	const __u8 *data;
+	__u32 len;
+	struct psample_flow_key *key;
+};
+
+static bool dissect_has(struct dissect *d, __u32 off, __u32 n)
+{
+	if (off <= d->len && n <= d->len - off)
+		return true;
+
+	d->key->flags |= PSAMPLE_FLOW_TRUNCATED;
+	return false;
+}
+
+static __u16 dissect_be16(const struct dissect *d, __u32 off)
+{
+	return d->data[off] << 8 | d->data[off + 1];
+}
+
+static __u32 dissect_be32(const struct dissect *d, __u32 off)
+{
+	return (__u32)dissect_be16(d, off) << 16 | dissect_be16(d, off + 2);
+}
+
+static void dissect_l4(struct dissect *d, __u32 off)
+{
+	struct psample_flow_key *key = d->key;
+	__u32 doff;
+
+	key->l4_off = off;
+	switch (key->ip_proto) {
+	case DISSECT_IPPROTO_TCP:
+	case DISSECT_IPPROTO_UDP:
+	case DISSECT_IPPROTO_UDPLITE:
+	case DISSECT_IPPROTO_SCTP:
+		break;
+	default:
+		return;
+	}
+
+	/* The ports come first and are kept even if the rest is cut */
+	if (!dissect_has(d, off, 4))
+		return;
+	key->sport = dissect_be16(d, off);
+	key->dport = dissect_be16(d, off + 2);
+	key->flags |= PSAMPLE_FLOW_PORTS;
+
+	switch (key->ip_proto) {
+	case DISSECT_IPPROTO_TCP:
+		if (!dissect_has(d, off, 14))
+			return;
+		key->tcp_flags = d->data[off + 13];
+		key->flags |= PSAMPLE_FLOW_TCP_FLAGS;
+		doff = (d->data[off + 12] >> 4) * 4;
+		if (doff < DISSECT_TCP_HLEN)
+			return;
+		key->payload_off = off + doff;
+		break;
+	case DISSECT_IPPROTO_SCTP:
+		key->payload_off = off + 12;
+		break;
+	default:
+		key->payload_off = off + 8;
+		break;
+	}
+}
+
+static void dissect_ipv4(struct dissect *d, __u32 off)
+{
+	struct psample_flow_key *key = d->key;
+	__u32 ihl;
+
+	if (!dissect_has(d, off, DISSECT_IPV4_HLEN))
+		return;
+
+	ihl = (d->data[off] & 0x0f) * 4;
+	if (ihl < DISSECT_IPV4_HLEN)
+		return;
+
+	key->flags |= PSAMPLE_FLOW_IPV4;
+	key->dscp = d->data[off + 1] >> 2;
+	key->ip_proto = d->data[off + 9];
+	memcpy(key->src, d->data + off + 12, 4);
+	memcpy(key->dst, d->data + off + 16, 4);
+
+	/* Fragment offset or more fragments */
+	if (dissect_be16(d, off + 6) & 0x3fff) {
+		key->flags |= PSAMPLE_FLOW_FRAGMENT;
+		if (dissect_be16(d, off + 6) & 0x1fff)
+			return;
+	}
+
+	dissect_l4(d, off + ihl);
+}
+
+static void dissect_ipv6(struct dissect *d, __u32 off)
+{
+	struct psample_flow_key *key = d->key;
+	__u8 nexthdr;
+	int i;
+
+	if (!dissect_has(d, off, DISSECT_IPV6_HLEN))
+		return;
+
+	key->flags |= PSAMPLE_FLOW_IPV6;
+	key->dscp = (dissect_be32(d, off) >> 22) & 0x3f;
+	nexthdr = d->data[off + 6];
+	memcpy(key->src, d->data + off + 8, 16);
+	memcpy(key->dst, d->data + off + 24, 16);
+	off += DISSECT_IPV6_HLEN;
+
+	for (i = 0; i < DISSECT_IPV6_EXT_MAX; i++) {
+		switch (nexthdr) {
+		case DISSECT_IPPROTO_HOPOPTS:
+		case DISSECT_IPPROTO_ROUTING:
+		case DISSECT_IPPROTO_DSTOPTS:
+			if (!dissect_has(d, off, 2))
+				return;
+			nexthdr = d->data[off];
+			off += (d->data[off + 1] + 1) * 8;
+			continue;
+		case DISSECT_IPPROTO_AH:
+			if (!dissect_has(d, off, 2))
+				return;
+			nexthdr = d->data[off];
+			off += (d->data[off + 1] + 2) * 4;
+			continue;
+		case DISSECT_IPPROTO_FRAGMENT:
+			if (!dissect_has(d, off, 8))
+				return;
+			key->flags |= PSAMPLE_FLOW_FRAGMENT;
+			key->ip_proto = d->data[off];
+			if (dissect_be16(d, off + 2) & 0xfff8)
+				return;
+			nexthdr = d->data[off];
+			off += 8;
+			continue;
+		}
+		break;
+	}
+
+	key->ip_proto = nexthdr;
+	dissect_l4(d, off);
+}
+
+static bool dissect_mpls(__u16 proto)
+{
+	return proto == DISSECT_ETH_P_MPLS_UC || proto == DISSECT_ETH_P_MPLS_MC;
+}
+
+/* Dissect the packet at off, an Ethernet frame if proto is
+ * DISSECT_ETH_P_TEB or the payload of an Ethernet frame of type proto.
+ */
+static void dissect_from(struct dissect *d, __u32 off, __u16 proto)
+{
+	struct psample_flow_key *key = d->key;
+	int vlans = 0;
+
+	if (proto == DISSECT_ETH_P_TEB) {
+		if (!dissect_has(d, off, DISSECT_ETH_HLEN))
+			return;
+		proto = dissect_be16(d, off + 12);
+		off += DISSECT_ETH_HLEN;
+	}
+
+	while ((proto == DISSECT_ETH_P_8021Q || proto == DISSECT_ETH_P_8021AD ||
+		proto == DISSECT_ETH_P_QINQ1) && vlans < DISSECT_VLAN_MAX) {
+		if (!dissect_has(d, off, DISSECT_VLAN_HLEN))
+			return;
+		if (!vlans) {
+			key->vlan = dissect_be16(d, off) & 0x0fff;
+			key->flags |= PSAMPLE_FLOW_VLAN;
+		} else if (vlans == 1) {
+			key->vlan_inner = dissect_be16(d, off) & 0x0fff;
+			key->flags |= PSAMPLE_FLOW_QINQ;
+		}
+		proto = dissect_be16(d, off + 2);
+		off += DISSECT_VLAN_HLEN;
+		vlans++;
+	}
+
+	key->eth_proto = proto;
+	key->l3_off = off;
+	if (proto == DISSECT_ETH_P_IP)
+		dissect_ipv4(d, off);
+	else if (proto == DISSECT_ETH_P_IPV6)
+		dissect_ipv6(d, off);
+}
+
+int psample_dissect(const __u8 *data, __u32 len, struct psample_flow_key *key)
+{
+	struct dissect d = { .data = data, .len = len, .key = key };
+
+	memset(key, 0, sizeof(*key));
+	if (!dissect_has(&d, 0, DISSECT_ETH_HLEN))
+		return -EINVAL;
+
+	dissect_from(&d, 0, DISSECT_ETH_P_TEB);
+	return 0;
+}
+
+/* Walk an MPLS label stack. The payload is told by its IP version, since
+ * MPLS does not carry its type.
+ */
+static bool dissect_encap_mpls(struct dissect *d, struct psample_flow *flow,
+			       __u32 *off, __u16 *proto)
+{
+	__u32 top = 0;
+	__u32 label;
+	int i;
+
+	for (i = 0; i < DISSECT_MPLS_MAX; i++) {
+		if (!dissect_has(d, *off, 4))
+			return false;
+		label = dissect_be32(d, *off);
+		if (!i)
+			top = label >> 12;
+		*off += 4;
+		if (label & 0x100)	/* bottom of stack */
+			break;
+	}
+	if (i == DISSECT_MPLS_MAX || !dissect_has(d, *off, 1))
+		return false;
+
+	switch (d->data[*off] >> 4) {
+	case 4:
+		*proto = DISSECT_ETH_P_IP;
+		break;
+	case 6:
+		*proto = DISSECT_ETH_P_IPV6;
+		break;
+	default:
+		return false;
+	}
+
+	flow->encap = PSAMPLE_ENCAP_MPLS;
+	flow->mpls_label = top;
+	flow->mpls_labels = i + 1;
+	return true;
+}
+
+static bool dissect_encap_udp(struct dissect *d, struct psample_flow *flow,
+			      __u32 *off, __u16 *proto)
+{
+	const struct psample_flow_key *key = d->key;
+
+	*off = key->payload_off;
+	switch (key->dport) {
+	case DISSECT_PORT_VXLAN:
+		if (!dissect_has(d, *off, DISSECT_VXLAN_HLEN) ||
+		    !(d->data[*off] & 0x08))
+			return false;
+		flow->vni = dissect_be32(d, *off + 4) >> 8;
+		flow->encap = PSAMPLE_ENCAP_VXLAN;
+		*off += DISSECT_VXLAN_HLEN;
+		*proto = DISSECT_ETH_P_TEB;
+		return true;
+	case DISSECT_PORT_GENEVE:
+		if (!dissect_has(d, *off, DISSECT_GENEVE_HLEN) ||
+		    d->data[*off] >> 6)
+			return false;
+		flow->vni = dissect_be32(d, *off + 4) >> 8;
+		flow->encap = PSAMPLE_ENCAP_GENEVE;
+		*proto = dissect_be16(d, *off + 2);
+		*off += DISSECT_GENEVE_HLEN + (d->data[*off] & 0x3f) * 4;
+		return true;
+	}
+
+	return false;
+}
+
+static bool dissect_encap_gre(struct dissect *d, struct psample_flow *flow,
+			      __u32 *off, __u16 *proto)
+{
+	__u16 gre_flags;
+	__u32 key = 0;
+	__u32 hlen;
+
+	*off = d->key->l4_off;
+	if (!dissect_has(d, *off, DISSECT_GRE_HLEN))
+		return false;
+
+	gre_flags = dissect_be16(d, *off);
+	if (gre_flags & 0x0007)	/* version 0 only */
+		return false;
+	*proto = dissect_be16(d, *off + 2);
+
+	hlen = DISSECT_GRE_HLEN;
+	if (gre_flags & 0x8000)	/* checksum */
+		hlen += 4;
+	if (gre_flags & 0x2000) {	/* key */
+		if (!dissect_has(d, *off + hlen, 4))
+			return false;
+		key = dissect_be32(d, *off + hlen);
+		hlen += 4;
+	}
+	if (gre_flags & 0x1000)	/* sequence number */
+		hlen += 4;
+
+	if ((gre_flags & 0x2000) && *proto == DISSECT_ETH_P_TEB) {
+		flow->encap = PSAMPLE_ENCAP_NVGRE;
+		flow->vni = key >> 8;
+	} else {
+		flow->encap = PSAMPLE_ENCAP_GRE;
+		flow->vni = key;
+	}
+	*off += hlen;
+	return true;
+}
+
+/* Find the packet encapsulated in the one of d->key */
+static bool dissect_encap_next(struct dissect *d, struct psample_flow *flow,
+			       __u32 *off, __u16 *proto)
+{
+	const struct psample_flow_key *key = d->key;
+
+	if (key->flags & PSAMPLE_FLOW_TRUNCATED)
+		return false;
+
+	if (dissect_mpls(key->eth_proto)) {
+		*off = key->l3_off;
+		return dissect_encap_mpls(d, flow, off, proto);
+	}
+
+	if (!key->l4_off)
+		return false;
+
+	switch (key->ip_proto) {
+	case DISSECT_IPPROTO_UDP:
+		return (key->flags & PSAMPLE_FLOW_PORTS) &&
+		       dissect_encap_udp(d, flow, off, proto);
+	case DISSECT_IPPROTO_GRE:
+		return dissect_encap_gre(d, flow, off, proto);
+	case DISSECT_IPPROTO_IPIP:
+	case DISSECT_IPPROTO_IPV6:
+		*off = key->l4_off;
+		*proto = key->ip_proto == DISSECT_IPPROTO_IPIP ?
+			 DISSECT_ETH_P_IP : DISSECT_ETH_P_IPV6;
+		flow->encap = PSAMPLE_ENCAP_IPIP;
+		return true;
+	}
+
+	return false;
+}
+
+int psample_dissect_encap(const __u8 *data, __u32 len, unsigned int depth,
+			  struct psample_flow *flow)
+{
+	struct dissect d = { .data = data, .len = len };
+	__u16 proto;
+	__u32 off;
+	int err;
+
+	memset(flow, 0, sizeof(*flow));
+	err = psample_dissect(data, len, &flow->outer);
+	if (err)
+		return err;
+
+	flow->inner = flow->outer;
+	d.key = &flow->inner;
+	while (flow->depth < depth &&
+	       dissect_encap_next(&d, flow, &off, &proto)) {
+		memset(&flow->inner, 0, sizeof(flow->inner));
+		dissect_from(&d, off, proto);
+		flow->depth++;
+	}
+
+	return 0;
+}
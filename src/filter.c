@@ -0,0 +1,326 @@
+/*
+ *   filter.c	Classic BPF socket filters for the psample sample socket
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/psample.h>
+
+#include "filter.h"
+
+/* The program is built from sections. Every section either drops the message
+ * or falls through to the next one, and the message is accepted after the
+ * last section. Jumps to the end of the current section, to the accepting
+ * return, to the dropping return or to a label of the section are resolved
+ * once their targets are known.
+ */
+enum filter_label {
+	FILTER_NEXT = -1,
+	FILTER_PASS = -2,
+	FILTER_DROP = -3,
+	FILTER_LOCAL = -4,	/* first label of filter_label_new() */
+};
+
+#define FILTER_ATTRS_OFF (sizeof(struct nlmsghdr) + sizeof(struct genlmsghdr))
+#define FILTER_CMD_OFF (sizeof(struct nlmsghdr) + \
+			offsetof(struct genlmsghdr, cmd))
+
+/* Scratch memory slots */
+#define FILTER_MEM_OFF 0
+#define FILTER_MEM_TMP 1
+
+enum filter_fixup_field {
+	FILTER_FIXUP_JT,
+	FILTER_FIXUP_JF,
+	FILTER_FIXUP_K,
+};
+
+struct filter_fixup {
+	unsigned int insn;
+	enum filter_fixup_field field;
+	int label;
+};
+
+struct filter {
+	struct sock_filter *insns;
+	unsigned int len;
+	struct filter_fixup *fixups;
+	unsigned int nfixups;
+	int next_label;
+	int err;
+};
+
+static void filter_stmt(struct filter *f, __u16 code, __u32 k)
+{
+	if (f->len == BPF_MAXINSNS) {
+		f->err = -E2BIG;
+		return;
+	}
+	f->insns[f->len++] = (struct sock_filter) BPF_STMT(code, k);
+}
+
+static void filter_fixup_add(struct filter *f, enum filter_fixup_field field,
+			     int label)
+{
+	struct filter_fixup *fixup = &f->fixups[f->nfixups++];
+
+	fixup->insn = f->len - 1;
+	fixup->field = field;
+	fixup->label = label;
+}
+
+static int filter_label_new(struct filter *f)
+{
+	return f->next_label--;
+}
+
+/* jt and jf are either relative offsets or one of enum filter_label */
+static void filter_jump(struct filter *f, __u16 code, __u32 k, int jt, int jf)
+{
+	if (f->len == BPF_MAXINSNS) {
+		f->err = -E2BIG;
+		return;
+	}
+	f->insns[f->len++] = (struct sock_filter)
+		BPF_JUMP(code, k, jt < 0 ? 0 : jt, jf < 0 ? 0 : jf);
+	if (jt < 0)
+		filter_fixup_add(f, FILTER_FIXUP_JT, jt);
+	if (jf < 0)
+		filter_fixup_add(f, FILTER_FIXUP_JF, jf);
+}
+
+/* Unconditional jump, not limited to the 255 instructions of jt and jf */
+static void filter_ja(struct filter *f, int label)
+{
+	filter_stmt(f, BPF_JMP | BPF_JA, 0);
+	if (!f->err)
+		filter_fixup_add(f, FILTER_FIXUP_K, label);
+}
+
+static void filter_resolve(struct filter *f, int label)
+{
+	unsigned int target = f->len;
+	unsigned int i;
+
+	for (i = 0; i < f->nfixups; i++) {
+		struct filter_fixup *fixup = &f->fixups[i];
+		unsigned int off;
+
+		if (fixup->label != label)
+			continue;
+
+		off = target - fixup->insn - 1;
+		if (off > 0xff && fixup->field != FILTER_FIXUP_K)
+			f->err = -E2BIG;
+		switch (fixup->field) {
+		case FILTER_FIXUP_JT:
+			f->insns[fixup->insn].jt = off;
+			break;
+		case FILTER_FIXUP_JF:
+			f->insns[fixup->insn].jf = off;
+			break;
+		case FILTER_FIXUP_K:
+			f->insns[fixup->insn].k = off;
+			break;
+		}
+		fixup->label = 0;
+	}
+}
+
+#if __BYTE_ORDER != __BIG_ENDIAN
+/* A = (A << 8) | byte at offset k of the attribute */
+static void filter_shift_in_byte(struct filter *f, __u32 k)
+{
+	filter_stmt(f, BPF_ALU | BPF_LSH | BPF_K, 8);
+	filter_stmt(f, BPF_ST, FILTER_MEM_TMP);
+	filter_stmt(f, BPF_LDX | BPF_MEM, FILTER_MEM_OFF);
+	filter_stmt(f, BPF_LD | BPF_B | BPF_IND, k);
+	filter_stmt(f, BPF_LDX | BPF_MEM, FILTER_MEM_TMP);
+	filter_stmt(f, BPF_ALU | BPF_OR | BPF_X, 0);
+}
+#endif
+
+/* Load the u32 attribute attr of the message into A, or jump to missing if
+ * the message does not carry it. BPF word loads are big endian, so on little
+ * endian hosts the value is put together from its bytes.
+ */
+static void filter_load_attr_u32(struct filter *f, int attr, int missing)
+{
+	filter_stmt(f, BPF_LD | BPF_IMM, FILTER_ATTRS_OFF);
+	filter_stmt(f, BPF_LDX | BPF_IMM, attr);
+	filter_stmt(f, BPF_LD | BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR);
+	filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	filter_ja(f, missing);
+	filter_stmt(f, BPF_MISC | BPF_TAX, 0);
+#if __BYTE_ORDER == __BIG_ENDIAN
+	filter_stmt(f, BPF_LD | BPF_W | BPF_IND, NLA_HDRLEN);
+#else
+	filter_stmt(f, BPF_STX, FILTER_MEM_OFF);
+	filter_stmt(f, BPF_LD | BPF_B | BPF_IND, NLA_HDRLEN + 3);
+	filter_shift_in_byte(f, NLA_HDRLEN + 2);
+	filter_shift_in_byte(f, NLA_HDRLEN + 1);
+	filter_shift_in_byte(f, NLA_HDRLEN);
+#endif
+}
+
+/* Jump to label if the message is not of the psample family, as are the
+ * replies and acks of the requests made on the socket.
+ */
+static void filter_family_jump(struct filter *f,
+			       const struct filter_opts *opts, int label)
+{
+	/* Half word loads are big endian, nlmsg_type is in host order */
+	filter_stmt(f, BPF_LD | BPF_H | BPF_ABS,
+		    offsetof(struct nlmsghdr, nlmsg_type));
+	filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, be16toh(opts->family), 0,
+		    label);
+}
+
+/* Binary search of A in the sorted groups. Long jumps are used, so the tree
+ * is not limited by the reach of conditional jumps.
+ */
+static void filter_group_tree(struct filter *f, const __u32 *groups,
+			      unsigned int n)
+{
+	unsigned int mid = n / 2;
+	int right;
+
+	if (n == 1) {
+		filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, groups[0], 0, 1);
+		filter_ja(f, FILTER_NEXT);
+		filter_ja(f, FILTER_DROP);
+		return;
+	}
+
+	right = filter_label_new(f);
+	filter_jump(f, BPF_JMP | BPF_JGE | BPF_K, groups[mid], 0, 1);
+	filter_ja(f, right);
+	filter_group_tree(f, groups, mid);
+	filter_resolve(f, right);
+	filter_group_tree(f, groups + mid, n - mid);
+}
+
+/* Messages of other groups are dropped, messages without a group pass */
+static void filter_group_section(struct filter *f,
+				 const struct filter_opts *opts)
+{
+	filter_load_attr_u32(f, PSAMPLE_ATTR_SAMPLE_GROUP, FILTER_NEXT);
+	filter_group_tree(f, opts->groups, opts->ngroups);
+	filter_resolve(f, FILTER_NEXT);
+}
+
+/* Samples are spread over the shards by their group sequence number. Config
+ * notifications and samples without a sequence number go to shard 0, and
+ * messages of other families to every shard.
+ */
+static void filter_shard_section(struct filter *f,
+				 const struct filter_opts *opts)
+{
+	int other = opts->shard_index ? FILTER_DROP : FILTER_NEXT;
+
+	filter_family_jump(f, opts, FILTER_NEXT);
+	filter_stmt(f, BPF_LD | BPF_B | BPF_ABS, FILTER_CMD_OFF);
+	filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, PSAMPLE_CMD_SAMPLE, 0, other);
+	filter_load_attr_u32(f, PSAMPLE_ATTR_GROUP_SEQ, other);
+	filter_stmt(f, BPF_ALU | BPF_MOD | BPF_K, opts->shard_count);
+	filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, opts->shard_index,
+		    FILTER_NEXT, FILTER_DROP);
+	filter_resolve(f, FILTER_NEXT);
+}
+
+/* Accept each sample with a probability of opts->keep. Config notifications
+ * and the messages of other families are always accepted.
+ */
+static void filter_shed_section(struct filter *f,
+				const struct filter_opts *opts)
+{
+	__u32 threshold = opts->keep * 4294967296.0;
+
+	filter_family_jump(f, opts, FILTER_NEXT);
+	filter_stmt(f, BPF_LD | BPF_B | BPF_ABS, FILTER_CMD_OFF);
+	filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, PSAMPLE_CMD_SAMPLE, 0,
+		    FILTER_NEXT);
+	filter_stmt(f, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+	filter_jump(f, BPF_JMP | BPF_JGE | BPF_K, threshold, FILTER_DROP,
+		    FILTER_NEXT);
+	filter_resolve(f, FILTER_NEXT);
+}
+
+/* Accept the message. With a snaplen, a sample is trimmed after the first
+ * snaplen bytes of PSAMPLE_ATTR_DATA, so the rest of the payload and any
+ * attribute after it is never copied to the socket. Other messages are
+ * accepted whole.
+ */
+static void filter_pass_section(struct filter *f,
+				const struct filter_opts *opts)
+{
+	int whole = filter_label_new(f);
+
+	if (opts->snaplen >= 0) {
+		filter_family_jump(f, opts, whole);
+		filter_stmt(f, BPF_LD | BPF_B | BPF_ABS, FILTER_CMD_OFF);
+		filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, PSAMPLE_CMD_SAMPLE, 0,
+			    whole);
+		filter_stmt(f, BPF_LD | BPF_IMM, FILTER_ATTRS_OFF);
+		filter_stmt(f, BPF_LDX | BPF_IMM, PSAMPLE_ATTR_DATA);
+		filter_stmt(f, BPF_LD | BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR);
+		filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0);
+		filter_stmt(f, BPF_ALU | BPF_ADD | BPF_K,
+			    NLA_HDRLEN + opts->snaplen);
+		filter_stmt(f, BPF_RET | BPF_A, 0);
+	}
+	filter_resolve(f, whole);
+	filter_stmt(f, BPF_RET | BPF_K, (__u32) -1);
+}
+
+bool filter_needed(const struct filter_opts *opts)
+{
+	return opts->ngroups || opts->shard_count > 1 ||
+	       opts->snaplen >= 0 || opts->keep < 1;
+}
+
+int filter_build(const struct filter_opts *opts, struct sock_fprog *fprog)
+{
+	struct filter f = { .next_label = FILTER_LOCAL };
+
+	f.insns = calloc(BPF_MAXINSNS, sizeof(*f.insns));
+	f.fixups = calloc(2 * BPF_MAXINSNS, sizeof(*f.fixups));
+	if (!f.insns || !f.fixups) {
+		f.err = -ENOMEM;
+		goto out;
+	}
+
+	if (opts->ngroups)
+		filter_group_section(&f, opts);
+	if (opts->shard_count > 1)
+		filter_shard_section(&f, opts);
+	if (opts->keep < 1)
+		filter_shed_section(&f, opts);
+
+	filter_resolve(&f, FILTER_PASS);
+	filter_pass_section(&f, opts);
+	filter_resolve(&f, FILTER_DROP);
+	filter_stmt(&f, BPF_RET | BPF_K, 0);
+
+out:
+	free(f.fixups);
+	if (f.err) {
+		free(f.insns);
+		return f.err;
+	}
+
+	fprog->filter = f.insns;
+	fprog->len = f.len;
+	return 0;
+}
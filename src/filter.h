@@ -0,0 +1,30 @@
+/*
+ *   filter.h	Classic BPF socket filters for the psample sample socket
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdbool.h>
+#include <linux/types.h>
+#include <linux/filter.h>
+
+struct filter_opts {
+	__u16 family;			/* nlmsg_type of psample messages */
+	__u32 *groups;			/* sorted, none to accept all groups */
+	unsigned int ngroups;
+	unsigned int shard_count;	/* 0 or 1 when not sharded */
+	unsigned int shard_index;
+	int snaplen;			/* -1 to keep the whole payload */
+	double keep;			/* fraction of samples to accept */
+};
+
+bool filter_needed(const struct filter_opts *opts);
+int filter_build(const struct filter_opts *opts, struct sock_fprog *fprog);
+
+#endif /* _FILTER_H_ */
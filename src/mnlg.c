@@ -10,11 +10,13 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/socket.h>
 #include <libmnl/libmnl.h>
 #include <linux/genetlink.h>
 
@@ -61,6 +63,216 @@ int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
 	return err;
 }
 
+/* Like mnlg_socket_recv_run(), but without waiting: fails with EAGAIN once
+ * the messages received so far are handled and the reply goes on.
+ */
+int mnlg_socket_recv_poll(struct mnlg_socket *nlg, mnl_cb_t data_cb,
+			  void *data)
+{
+	ssize_t len;
+	int err;
+
+	do {
+		len = recv(mnl_socket_get_fd(nlg->nl), nlg->buf,
+			   MNL_SOCKET_BUFFER_SIZE, MSG_DONTWAIT);
+		if (len <= 0)
+			return len;
+		err = mnl_cb_run(nlg->buf, len, nlg->seq, nlg->portid,
+				 data_cb, data);
+	} while (err > 0);
+
+	return err;
+}
+
+static void mnlg_batch_free(struct mnlg_batch *batch)
+{
+	free(batch->bufs);
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->addrs);
+}
+
+int mnlg_socket_batch_set(struct mnlg_socket *nlg, unsigned int size)
+{
+	struct mnlg_batch batch = {};
+	unsigned int i;
+
+	if (!size || nlg->batch.next < nlg->batch.count) {
+		errno = size ? EBUSY : EINVAL;
+		return -1;
+	}
+
+	batch.bufs = malloc((size_t)size * MNL_SOCKET_BUFFER_SIZE);
+	batch.msgs = calloc(size, sizeof(*batch.msgs));
+	batch.iovs = calloc(size, sizeof(*batch.iovs));
+	batch.addrs = calloc(size, sizeof(*batch.addrs));
+	if (!batch.bufs || !batch.msgs || !batch.iovs || !batch.addrs) {
+		mnlg_batch_free(&batch);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < size; i++) {
+		batch.iovs[i].iov_base = batch.bufs +
+					 (size_t)i * MNL_SOCKET_BUFFER_SIZE;
+		batch.iovs[i].iov_len = MNL_SOCKET_BUFFER_SIZE;
+		batch.msgs[i].msg_hdr.msg_iov = &batch.iovs[i];
+		batch.msgs[i].msg_hdr.msg_iovlen = 1;
+		batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+	}
+	batch.size = size;
+
+	mnlg_batch_free(&nlg->batch);
+	nlg->batch = batch;
+	return 0;
+}
+
+/* Have datagram i of the next batches received into buf, of
+ * MNL_SOCKET_BUFFER_SIZE bytes, or into the batch's own buffer again if buf
+ * is NULL. The io_uring backend always uses its own buffers.
+ */
+void mnlg_batch_buf_set(struct mnlg_socket *nlg, unsigned int i, void *buf)
+{
+	struct mnlg_batch *batch = &nlg->batch;
+
+	batch->iovs[i].iov_base = buf ? buf : batch->bufs +
+				  (size_t)i * MNL_SOCKET_BUFFER_SIZE;
+}
+
+/* Receive up to batch->size datagrams with a single syscall. The flags are
+ * passed to recvmmsg(), so MSG_WAITFORONE blocks for the first datagram only
+ * and MSG_DONTWAIT never blocks.
+ */
+static int mnlg_socket_batch_recv(struct mnlg_socket *nlg, unsigned int max,
+				  int flags)
+{
+	struct mnlg_batch *batch = &nlg->batch;
+	unsigned int i;
+	int ret;
+
+	if (nlg->uring) {
+		ret = mnlg_socket_uring_recv(nlg, max, flags);
+		if (ret >= 0 || errno != EOPNOTSUPP)
+			return ret;
+
+		/* No multishot recvmsg in this kernel, use recvmmsg() */
+		mnlg_socket_uring_disable(nlg);
+		if (mnlg_socket_batch_set(nlg, batch->size) < 0)
+			return -1;
+	}
+
+	if (max > batch->size)
+		max = batch->size;
+
+	for (i = 0; i < max; i++)
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+
+	ret = recvmmsg(mnl_socket_get_fd(nlg->nl), batch->msgs, max, flags,
+		       NULL);
+	if (ret <= 0)
+		return ret;
+
+	nlg->stats.recv_calls++;
+	nlg->stats.recv_msgs += ret;
+	batch->count = ret;
+	batch->next = 0;
+	return ret;
+}
+
+/* Datagram i of the batch, or NULL with errno set if it must be skipped. The
+ * length received is returned in len.
+ */
+struct nlmsghdr *mnlg_batch_datagram(struct mnlg_socket *nlg, unsigned int i,
+				     unsigned int *len)
+{
+	struct mnlg_batch *batch = &nlg->batch;
+	struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+	struct nlmsghdr *nlh = batch->iovs[i].iov_base;
+
+	if (hdr->msg_flags & MSG_TRUNC) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if (batch->addrs[i].nl_pid != 0) {
+		errno = ESRCH;
+		return NULL;
+	}
+
+	/* A socket filter may trim a message by returning a shorter length.
+	 * Make the header match what was received, so the message is not
+	 * skipped; its last attribute is then the truncated one.
+	 */
+	*len = batch->msgs[i].msg_len;
+	if (*len >= sizeof(*nlh) && nlh->nlmsg_len > *len)
+		nlh->nlmsg_len = *len;
+
+	return nlh;
+}
+
+static int mnlg_batch_cb_run(struct mnlg_socket *nlg, mnl_cb_t data_cb,
+			     void *data)
+{
+	struct nlmsghdr *nlh;
+	unsigned int len;
+
+	nlh = mnlg_batch_datagram(nlg, nlg->batch.next++, &len);
+	if (!nlh)
+		return -1;
+
+	return mnl_cb_run(nlh, len, nlg->seq, nlg->portid, data_cb, data);
+}
+
+/* Make sure that datagrams are pending in the batch, receiving up to max new
+ * ones if there are none. Returns the number pending, or -1 with errno set.
+ * Overruns are counted and receiving goes on.
+ */
+int mnlg_socket_batch_fill(struct mnlg_socket *nlg, unsigned int max,
+			   int flags)
+{
+	struct mnlg_batch *batch = &nlg->batch;
+	int err;
+
+	while (batch->next == batch->count) {
+		err = mnlg_socket_batch_recv(nlg, max, flags);
+		if (err < 0 && errno == ENOBUFS) {
+			nlg->stats.overruns++;
+			continue;
+		}
+		if (err <= 0)
+			return err;
+	}
+
+	return batch->count - batch->next;
+}
+
+/* Like mnlg_socket_recv_run(), but datagrams are received in batches. If the
+ * callback stops the run, the rest of the batch is kept and handled first on
+ * the next call. A socket overrun (ENOBUFS) only means that messages were
+ * lost, so it is counted and receiving goes on.
+ *
+ * If budget is not NULL, at most *budget datagrams are handled and *budget is
+ * decreased by the number of datagrams handled.
+ */
+int mnlg_socket_batch_run(struct mnlg_socket *nlg, int flags,
+			  unsigned int *budget, mnl_cb_t data_cb, void *data)
+{
+	int err = 1;
+
+	do {
+		if (budget && !*budget)
+			break;
+		err = mnlg_socket_batch_fill(nlg, budget ? *budget : UINT_MAX,
+					     flags);
+		if (err <= 0)
+			break;
+		err = mnlg_batch_cb_run(nlg, data_cb, data);
+		if (budget)
+			(*budget)--;
+	} while (err > 0);
+
+	return err;
+}
+
 struct group_info {
 	bool found;
 	uint32_t id;
@@ -178,6 +390,16 @@ int mnlg_socket_get_fd(struct mnlg_socket *nlg)
 	return mnl_socket_get_fd(nlg->nl);
 }
 
+/* The fd to wait on for received datagrams. With the io_uring backend the
+ * socket is drained by the kernel, so readiness is signalled on the ring.
+ */
+int mnlg_socket_get_poll_fd(struct mnlg_socket *nlg)
+{
+	if (nlg->uring)
+		return mnlg_socket_uring_get_fd(nlg);
+	return mnl_socket_get_fd(nlg->nl);
+}
+
 static int get_family_id_attr_cb(const struct nlattr *attr, void *data)
 {
 	const struct nlattr **tb = data;
@@ -212,7 +434,7 @@ struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t version)
 	struct nlmsghdr *nlh;
 	int err;
 
-	nlg = malloc(sizeof(*nlg));
+	nlg = calloc(1, sizeof(*nlg));
 	if (!nlg)
 		return NULL;
 
@@ -258,7 +480,9 @@ err_buf_alloc:
 
 void mnlg_socket_close(struct mnlg_socket *nlg)
 {
+	mnlg_socket_uring_disable(nlg);
 	mnl_socket_close(nlg->nl);
+	mnlg_batch_free(&nlg->batch);
 	free(nlg->buf);
 	free(nlg);
 }
@@ -12,8 +12,28 @@
 #ifndef _MNLG_H_
 #define _MNLG_H_
 
+#include <sys/socket.h>
+#include <linux/netlink.h>
 #include <libmnl/libmnl.h>
 
+struct mnlg_batch {
+	unsigned int size;
+	unsigned int count;
+	unsigned int next;
+	char *bufs;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_nl *addrs;
+};
+
+struct mnlg_stats {
+	uint64_t recv_calls;
+	uint64_t recv_msgs;
+	uint64_t overruns;
+};
+
+struct mnlg_uring;
+
 struct mnlg_socket {
 	struct mnl_socket *nl;
 	char *buf;
@@ -21,6 +41,9 @@ struct mnlg_socket {
 	uint8_t version;
 	unsigned int seq;
 	unsigned int portid;
+	struct mnlg_batch batch;
+	struct mnlg_stats stats;
+	struct mnlg_uring *uring;
 };
 
 struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
@@ -28,9 +51,25 @@ struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 				  uint8_t version);
 int mnlg_socket_send(struct mnlg_socket *nlg, const struct nlmsghdr *nlh);
 int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data);
+int mnlg_socket_recv_poll(struct mnlg_socket *nlg, mnl_cb_t data_cb,
+			  void *data);
+int mnlg_socket_batch_set(struct mnlg_socket *nlg, unsigned int size);
+void mnlg_batch_buf_set(struct mnlg_socket *nlg, unsigned int i, void *buf);
+int mnlg_socket_batch_fill(struct mnlg_socket *nlg, unsigned int max,
+			   int flags);
+struct nlmsghdr *mnlg_batch_datagram(struct mnlg_socket *nlg, unsigned int i,
+				     unsigned int *len);
+int mnlg_socket_batch_run(struct mnlg_socket *nlg, int flags,
+			  unsigned int *budget, mnl_cb_t data_cb, void *data);
+int mnlg_socket_uring_enable(struct mnlg_socket *nlg, unsigned int entries);
+void mnlg_socket_uring_disable(struct mnlg_socket *nlg);
+int mnlg_socket_uring_recv(struct mnlg_socket *nlg, unsigned int max,
+			   int flags);
+int mnlg_socket_uring_get_fd(struct mnlg_socket *nlg);
 int mnlg_socket_group_add(struct mnlg_socket *nlg, const char *group_name);
 struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t version);
 void mnlg_socket_close(struct mnlg_socket *nlg);
 int mnlg_socket_get_fd(struct mnlg_socket *nlg);
+int mnlg_socket_get_poll_fd(struct mnlg_socket *nlg);
 
 #endif /* _MNLG_H_ */
@@ -0,0 +1,308 @@
+/*
+ *   mnlg_uring.c	io_uring receive backend for the mnlg batch helpers
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libmnl/libmnl.h>
+
+#include "mnlg.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#define MNLG_URING_BGID 0
+
+/* A multishot recvmsg is posted once on the socket and keeps completing, one
+ * CQE per datagram, into buffers picked by the kernel from a provided buffer
+ * ring. Buffers of a batch are given back to the ring when the next batch is
+ * received.
+ */
+struct mnlg_uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned int entries;
+	unsigned int buf_size;
+	struct msghdr msg;
+	uint16_t *bids;
+	unsigned int nbids;
+	bool armed;
+	bool received;
+};
+
+static char *mnlg_uring_buf(struct mnlg_uring *u, uint16_t bid)
+{
+	return u->bufs + (size_t)bid * u->buf_size;
+}
+
+static void mnlg_uring_buf_recycle(struct mnlg_uring *u, uint16_t bid,
+				   int offset)
+{
+	io_uring_buf_ring_add(u->br, mnlg_uring_buf(u, bid), u->buf_size, bid,
+			      io_uring_buf_ring_mask(u->entries), offset);
+}
+
+static void mnlg_uring_free(struct mnlg_uring *u)
+{
+	free(u->bufs);
+	free(u->bids);
+	free(u);
+}
+
+/* Post the multishot recvmsg and submit it at once, so that the ring fd
+ * becomes readable when a datagram comes, whether or not it is received yet.
+ */
+static int mnlg_uring_arm(struct mnlg_uring *u, int fd)
+{
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = io_uring_get_sqe(&u->ring);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	io_uring_prep_recvmsg_multishot(sqe, fd, &u->msg, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = MNLG_URING_BGID;
+
+	err = io_uring_submit(&u->ring);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+
+	u->armed = true;
+	return 0;
+}
+
+int mnlg_socket_uring_enable(struct mnlg_socket *nlg, unsigned int entries)
+{
+	struct io_uring_params params = {};
+	struct mnlg_uring *u;
+	unsigned int i;
+	int err;
+
+	/* Buffer rings must be a power of two and bids are 16 bits */
+	if (!entries || entries > 32768 || (entries & (entries - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -1;
+
+	u->entries = entries;
+	u->msg.msg_namelen = sizeof(struct sockaddr_nl);
+	u->buf_size = sizeof(struct io_uring_recvmsg_out) +
+		      sizeof(struct sockaddr_nl) + MNL_SOCKET_BUFFER_SIZE;
+	u->bids = calloc(entries, sizeof(*u->bids));
+	if (!u->bids)
+		goto err_alloc;
+	if (posix_memalign((void **)&u->bufs, sysconf(_SC_PAGESIZE),
+			   (size_t)entries * u->buf_size))
+		goto err_alloc;
+
+	/* Every datagram is a CQE, so size the CQ ring like the buffer ring */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries;
+	err = io_uring_queue_init_params(8, &u->ring, &params);
+	if (err < 0) {
+		errno = -err;
+		goto err_alloc;
+	}
+
+	u->br = io_uring_setup_buf_ring(&u->ring, entries, MNLG_URING_BGID, 0,
+					&err);
+	if (!u->br) {
+		errno = -err;
+		goto err_buf_ring;
+	}
+
+	for (i = 0; i < entries; i++)
+		mnlg_uring_buf_recycle(u, i, i);
+	io_uring_buf_ring_advance(u->br, entries);
+
+	/* The ring fd may be polled before anything is received */
+	if (mnlg_uring_arm(u, mnl_socket_get_fd(nlg->nl)) < 0)
+		goto err_arm;
+
+	nlg->uring = u;
+	return 0;
+
+err_arm:
+	err = errno;
+	io_uring_free_buf_ring(&u->ring, u->br, entries, MNLG_URING_BGID);
+	errno = err;
+err_buf_ring:
+	io_uring_queue_exit(&u->ring);
+err_alloc:
+	err = errno;
+	mnlg_uring_free(u);
+	errno = err;
+	return -1;
+}
+
+void mnlg_socket_uring_disable(struct mnlg_socket *nlg)
+{
+	struct mnlg_uring *u = nlg->uring;
+
+	if (!u)
+		return;
+
+	io_uring_free_buf_ring(&u->ring, u->br, u->entries, MNLG_URING_BGID);
+	io_uring_queue_exit(&u->ring);
+	mnlg_uring_free(u);
+	nlg->uring = NULL;
+}
+
+/* Reap up to max completions into the batch. Returns the number of datagrams
+ * received, or -1 with errno set. EOPNOTSUPP means that the kernel does not
+ * support multishot recvmsg and that the caller should fall back.
+ */
+int mnlg_socket_uring_recv(struct mnlg_socket *nlg, unsigned int max,
+			   int flags)
+{
+	struct mnlg_batch *batch = &nlg->batch;
+	struct mnlg_uring *u = nlg->uring;
+	int fd = mnl_socket_get_fd(nlg->nl);
+	struct io_uring_cqe *cqe;
+	unsigned int consumed;
+	unsigned int head;
+	unsigned int n = 0;
+	unsigned int i;
+	int err = 0;
+	int ret;
+
+	for (i = 0; i < u->nbids; i++)
+		mnlg_uring_buf_recycle(u, u->bids[i], i);
+	io_uring_buf_ring_advance(u->br, u->nbids);
+	u->nbids = 0;
+
+	/* Keep at least half of the buffers in the ring for the kernel */
+	if (max > batch->size)
+		max = batch->size;
+	if (max > u->entries / 2)
+		max = u->entries > 1 ? u->entries / 2 : 1;
+
+	do {
+		if (!u->armed && mnlg_uring_arm(u, fd) < 0)
+			return -1;
+
+		if (flags & MSG_DONTWAIT)
+			ret = io_uring_submit(&u->ring);
+		else
+			ret = io_uring_submit_and_wait(&u->ring, 1);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		nlg->stats.recv_calls++;
+
+		consumed = 0;
+		io_uring_for_each_cqe(&u->ring, head, cqe) {
+			struct io_uring_recvmsg_out *out;
+			uint16_t bid;
+
+			if (n == max)
+				break;
+			consumed++;
+
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				u->armed = false;
+
+			if (cqe->res < 0) {
+				if ((cqe->res == -EINVAL ||
+				     cqe->res == -EOPNOTSUPP) && !u->received)
+					err = EOPNOTSUPP;
+				else
+					err = -cqe->res;
+				continue;
+			}
+			if (!(cqe->flags & IORING_CQE_F_BUFFER))
+				continue;
+
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			u->bids[u->nbids++] = bid;
+			out = io_uring_recvmsg_validate(mnlg_uring_buf(u, bid),
+							cqe->res, &u->msg);
+			if (!out || out->namelen < sizeof(struct sockaddr_nl))
+				continue;
+
+			memcpy(&batch->addrs[n], io_uring_recvmsg_name(out),
+			       sizeof(batch->addrs[n]));
+			batch->iovs[n].iov_base =
+				io_uring_recvmsg_payload(out, &u->msg);
+			batch->msgs[n].msg_len =
+				io_uring_recvmsg_payload_length(out, cqe->res,
+								&u->msg);
+			batch->msgs[n].msg_hdr.msg_flags = out->flags;
+			u->received = true;
+			n++;
+		}
+		io_uring_cq_advance(&u->ring, consumed);
+
+		/* The multishot recvmsg ended, on an empty buffer ring for
+		 * instance. Post it again before returning, or a poller of the
+		 * ring fd would never be woken again. If that fails, the next
+		 * call tries again.
+		 */
+		if (!u->armed && err != EOPNOTSUPP &&
+		    mnlg_uring_arm(u, fd) < 0 && !n)
+			return -1;
+	} while (!n && !err && !(flags & MSG_DONTWAIT));
+
+	if (!n) {
+		errno = err ? err : EAGAIN;
+		return -1;
+	}
+
+	nlg->stats.recv_msgs += n;
+	batch->count = n;
+	batch->next = 0;
+	return n;
+}
+
+int mnlg_socket_uring_get_fd(struct mnlg_socket *nlg)
+{
+	return nlg->uring->ring.ring_fd;
+}
+
+#else /* HAVE_LIBURING */
+
+int mnlg_socket_uring_enable(struct mnlg_socket *nlg, unsigned int entries)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+void mnlg_socket_uring_disable(struct mnlg_socket *nlg)
+{
+}
+
+int mnlg_socket_uring_recv(struct mnlg_socket *nlg, unsigned int max,
+			   int flags)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int mnlg_socket_uring_get_fd(struct mnlg_socket *nlg)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+#endif /* HAVE_LIBURING */
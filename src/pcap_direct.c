@@ -0,0 +1,332 @@
+/*
+ *   pcap_direct.c	io_uring O_DIRECT output of the pcap writer
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "pcap_direct.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#define PCAP_DIRECT_BUF_SIZE	(1024 * 1024)
+#define PCAP_DIRECT_DEPTH	4
+#define PCAP_DIRECT_PREALLOC	(64 * 1024 * 1024)
+
+#define PCAP_DIRECT_ROUNDUP(len) \
+	(((len) + PCAP_DIRECT_ALIGN - 1) & ~(size_t)(PCAP_DIRECT_ALIGN - 1))
+
+struct pcap_direct_buf {
+	char *data;
+	size_t len;
+	size_t write_len;	/* of the write in flight */
+	bool busy;
+};
+
+/* The file is written through aligned buffers, each one written whole at an
+ * aligned offset while the next ones are filled. When the file has to be
+ * written before a buffer is full, the buffer is written rounded up to a
+ * block, and its last partial block is carried into the next buffer, which
+ * rewrites it. That write is drained, so that it lands after the first one.
+ * The file is cut to the length of the data when it is closed.
+ */
+struct pcap_direct {
+	struct io_uring ring;
+	int fd;
+	int err;
+	struct pcap_direct_buf *bufs;
+	unsigned int nbufs;
+	unsigned int cur;	/* being filled */
+	size_t buf_size;
+	__u64 off;		/* file offset of the current buffer */
+	__u64 size;		/* of the data */
+	__u64 allocated;
+	size_t prealloc;
+	bool rewrite;		/* the current buffer starts with a block
+				 * that is already being written
+				 */
+	bool dirty;		/* data since that write */
+};
+
+/* Wait for a write to complete, and return its error in write_err. Returns
+ * -errno if no write could be waited for.
+ */
+static int pcap_direct_reap(struct pcap_direct *d, int *write_err)
+{
+	struct pcap_direct_buf *buf;
+	struct io_uring_cqe *cqe;
+	int err;
+
+	do
+		err = io_uring_wait_cqe(&d->ring, &cqe);
+	while (err == -EINTR);
+	if (err)
+		return err;
+
+	buf = &d->bufs[io_uring_cqe_get_data64(cqe)];
+	buf->busy = false;
+	*write_err = 0;
+	if (cqe->res < 0)
+		*write_err = cqe->res;
+	else if ((size_t)cqe->res != buf->write_len)
+		*write_err = -EIO;
+	io_uring_cqe_seen(&d->ring, cqe);
+	return 0;
+}
+
+static int pcap_direct_wait(struct pcap_direct *d, struct pcap_direct_buf *buf)
+{
+	int write_err;
+	int err;
+
+	while (buf->busy) {
+		err = pcap_direct_reap(d, &write_err);
+		if (!err)
+			err = write_err;
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Allocate the blocks of the file ahead of the writes, so that they do not
+ * allocate them, unless the file system cannot. The size is left alone, and
+ * a file left by a killed process ends with the last block written.
+ */
+static void pcap_direct_prealloc(struct pcap_direct *d, __u64 end)
+{
+	while (d->prealloc && end > d->allocated) {
+		if (fallocate(d->fd, FALLOC_FL_KEEP_SIZE, d->allocated,
+			      d->prealloc)) {
+			d->prealloc = 0;
+			break;
+		}
+		d->allocated += d->prealloc;
+	}
+}
+
+static int pcap_direct_submit(struct pcap_direct *d, size_t len)
+{
+	struct pcap_direct_buf *buf = &d->bufs[d->cur];
+	struct io_uring_sqe *sqe;
+	int err;
+
+	pcap_direct_prealloc(d, d->off + len);
+
+	sqe = io_uring_get_sqe(&d->ring);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_write(sqe, d->fd, buf->data, len, d->off);
+	io_uring_sqe_set_data64(sqe, d->cur);
+	if (d->rewrite)
+		sqe->flags |= IOSQE_IO_DRAIN;
+	buf->write_len = len;
+	buf->busy = true;
+
+	err = io_uring_submit(&d->ring);
+	return err < 0 ? err : 0;
+}
+
+/* Move on to the next buffer, carrying the last carry bytes of the current
+ * one, which was written up to off_delta.
+ */
+static int pcap_direct_next(struct pcap_direct *d, size_t off_delta,
+			    size_t carry)
+{
+	struct pcap_direct_buf *prev = &d->bufs[d->cur];
+	struct pcap_direct_buf *buf;
+	int err;
+
+	d->cur = (d->cur + 1) % d->nbufs;
+	buf = &d->bufs[d->cur];
+	err = pcap_direct_wait(d, buf);
+	if (err)
+		return err;
+
+	memcpy(buf->data, prev->data + off_delta, carry);
+	buf->len = carry;
+	d->off += off_delta;
+	d->rewrite = carry != 0;
+	d->dirty = false;
+	return 0;
+}
+
+int pcap_direct_write(struct pcap_direct *d, const struct iovec *iov,
+		      int iovcnt)
+{
+	struct pcap_direct_buf *buf;
+	const char *p;
+	size_t left;
+	size_t n;
+	int i;
+
+	if (d->err)
+		return d->err;
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		left = iov[i].iov_len;
+		d->size += left;
+
+		while (left) {
+			d->dirty = true;
+			buf = &d->bufs[d->cur];
+			n = d->buf_size - buf->len;
+			if (n > left)
+				n = left;
+			memcpy(buf->data + buf->len, p, n);
+			buf->len += n;
+			p += n;
+			left -= n;
+
+			if (buf->len < d->buf_size)
+				continue;
+
+			d->err = pcap_direct_submit(d, d->buf_size);
+			if (!d->err)
+				d->err = pcap_direct_next(d, d->buf_size, 0);
+			if (d->err)
+				return d->err;
+		}
+	}
+
+	return 0;
+}
+
+/* Write what is buffered, without waiting for it */
+int pcap_direct_sync(struct pcap_direct *d)
+{
+	struct pcap_direct_buf *buf = &d->bufs[d->cur];
+	size_t aligned;
+	size_t carry;
+
+	if (d->err)
+		return d->err;
+	if (!d->dirty)
+		return 0;
+
+	aligned = PCAP_DIRECT_ROUNDUP(buf->len);
+	carry = buf->len % PCAP_DIRECT_ALIGN;
+	memset(buf->data + buf->len, 0, aligned - buf->len);
+	d->err = pcap_direct_submit(d, aligned);
+	if (!d->err)
+		d->err = pcap_direct_next(d, buf->len - carry, carry);
+	return d->err;
+}
+
+struct pcap_direct *pcap_direct_open(int fd, size_t buf_size,
+				     unsigned int depth, size_t prealloc)
+{
+	struct pcap_direct *d;
+	unsigned int i;
+	int err;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	d->fd = fd;
+	d->buf_size = PCAP_DIRECT_ROUNDUP(buf_size ? buf_size :
+					  PCAP_DIRECT_BUF_SIZE);
+	d->nbufs = (depth ? depth : PCAP_DIRECT_DEPTH) + 1;
+	d->prealloc = prealloc ? PCAP_DIRECT_ROUNDUP(prealloc) :
+				 PCAP_DIRECT_PREALLOC;
+	d->bufs = calloc(d->nbufs, sizeof(*d->bufs));
+	if (!d->bufs)
+		goto err_free;
+	for (i = 0; i < d->nbufs; i++)
+		if (posix_memalign((void **)&d->bufs[i].data,
+				   PCAP_DIRECT_ALIGN, d->buf_size))
+			goto err_free;
+
+	err = io_uring_queue_init(d->nbufs, &d->ring, 0);
+	if (err < 0) {
+		errno = -err;
+		goto err_free;
+	}
+
+	return d;
+
+err_free:
+	err = errno;
+	if (d->bufs)
+		for (i = 0; i < d->nbufs; i++)
+			free(d->bufs[i].data);
+	free(d->bufs);
+	free(d);
+	errno = err;
+	return NULL;
+}
+
+/* Write the rest, wait for every write and cut the file to its data. If
+ * writes can not be waited for, their buffers are leaked rather than freed
+ * while the kernel may still read them.
+ */
+int pcap_direct_close(struct pcap_direct *d)
+{
+	int wait_err = 0;
+	int write_err;
+	unsigned int i;
+	int err;
+
+	err = pcap_direct_sync(d);
+	for (i = 0; i < d->nbufs; i++) {
+		/* A failed write does not stop waiting for the others */
+		while (d->bufs[i].busy && !wait_err) {
+			wait_err = pcap_direct_reap(d, &write_err);
+			if (!err)
+				err = wait_err ? wait_err : write_err;
+		}
+	}
+	for (i = 0; i < d->nbufs; i++)
+		if (!d->bufs[i].busy)
+			free(d->bufs[i].data);
+	if (ftruncate(d->fd, d->size) && !err)
+		err = -errno;
+
+	io_uring_queue_exit(&d->ring);
+	free(d->bufs);
+	free(d);
+	return err;
+}
+
+#else /* HAVE_LIBURING */
+
+struct pcap_direct *pcap_direct_open(int fd, size_t buf_size,
+				     unsigned int depth, size_t prealloc)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+int pcap_direct_write(struct pcap_direct *d, const struct iovec *iov,
+		      int iovcnt)
+{
+	return -EOPNOTSUPP;
+}
+
+int pcap_direct_sync(struct pcap_direct *d)
+{
+	return -EOPNOTSUPP;
+}
+
+int pcap_direct_close(struct pcap_direct *d)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* HAVE_LIBURING */
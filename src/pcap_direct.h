@@ -0,0 +1,28 @@
+/*
+ *   pcap_direct.h	io_uring O_DIRECT output of the pcap writer
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _PCAP_DIRECT_H_
+#define _PCAP_DIRECT_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Offsets, lengths and buffers of O_DIRECT writes are multiples of this */
+#define PCAP_DIRECT_ALIGN	4096
+
+struct pcap_direct;
+
+struct pcap_direct *pcap_direct_open(int fd, size_t buf_size,
+				     unsigned int depth, size_t prealloc);
+int pcap_direct_write(struct pcap_direct *d, const struct iovec *iov,
+		      int iovcnt);
+int pcap_direct_sync(struct pcap_direct *d);
+int pcap_direct_close(struct pcap_direct *d);
+
+#endif /* _PCAP_DIRECT_H_ */
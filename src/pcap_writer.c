@@ -0,0 +1,586 @@
+/*
+ *   pcap_writer.c	Zero-copy pcap and pcapng file writer
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "pcap_writer.h"
+#include "pcap_direct.h"
+
+/* The file layout of https://www.tcpdump.org/manpages/pcap-savefile.5.html,
+ * in host byte order like libpcap writes it.
+ */
+#define PCAP_WRITER_MAGIC		0xa1b2c3d4
+#define PCAP_WRITER_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_WRITER_VERSION_MAJOR	2
+#define PCAP_WRITER_VERSION_MINOR	4
+
+struct pcap_writer_file_hdr {
+	__u32 magic;
+	__u16 version_major;
+	__u16 version_minor;
+	__s32 thiszone;
+	__u32 sigfigs;
+	__u32 snaplen;
+	__u32 linktype;
+};
+
+struct pcap_writer_pkthdr {
+	__u32 ts_sec;
+	__u32 ts_frac;			/* usec, or nsec with PCAP_WRITER_NSEC */
+	__u32 caplen;
+	__u32 len;
+};
+
+/* The blocks of https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng,
+ * in host byte order too. Every block ends with its total length again.
+ */
+#define PCAPNG_BYTE_ORDER_MAGIC		0x1a2b3c4d
+#define PCAPNG_BLOCK_SHB		0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB		0x00000001
+#define PCAPNG_BLOCK_EPB		0x00000006
+
+#define PCAPNG_OPT_ENDOFOPT		0
+#define PCAPNG_OPT_CUSTOM_BIN		2989
+#define PCAPNG_SHB_USERAPPL		4
+#define PCAPNG_IF_NAME			2
+#define PCAPNG_IF_DESCRIPTION		3
+#define PCAPNG_IF_TSRESOL		9
+
+#define PCAPNG_ALIGN(len)		(((len) + 3) & ~3U)
+
+struct pcapng_shb {
+	__u32 type;
+	__u32 total_len;
+	__u32 byte_order_magic;
+	__u16 version_major;
+	__u16 version_minor;
+	__s64 section_len;
+};
+
+struct pcapng_idb {
+	__u32 type;
+	__u32 total_len;
+	__u16 linktype;
+	__u16 reserved;
+	__u32 snaplen;
+};
+
+struct pcapng_epb {
+	__u32 type;
+	__u32 total_len;
+	__u32 iface;
+	__u32 ts_high;
+	__u32 ts_low;
+	__u32 caplen;
+	__u32 orig_len;
+};
+
+struct pcapng_opt {
+	__u16 code;
+	__u16 len;
+};
+
+/* Big enough for an interface description block */
+#define PCAP_WRITER_HDR_MAX	128
+
+/* Padding of the data, options, end of options and the block length */
+#define PCAP_WRITER_TAIL_MAX	(3 + PCAP_WRITER_OPTS_MAX + 8)
+
+/* The scratch of a record: what goes before and after its data, each written
+ * with an iovec of its own. The data in between is not copied.
+ */
+struct pcap_writer_rec {
+	__u8 hdr[PCAP_WRITER_HDR_MAX];
+	__u8 tail[PCAP_WRITER_TAIL_MAX];
+};
+
+/* iovs[0] is the staging buffer, then three iovecs per queued record */
+#define PCAP_WRITER_RECS	((IOV_MAX - 1) / 3)
+
+#define PCAP_WRITER_STAGE_SIZE	(64 * 1024)
+
+/* Records are queued as iovecs pointing at the caller's data, which must stay
+ * valid until the end of the batch. At the end of a batch, the queue is
+ * either written with a single writev(), or, if the flush policy says it is
+ * not time yet, copied into the staging buffer. The staging buffer is
+ * written in front of the queue by the next flush.
+ *
+ * With a direct output, there is no staging buffer: the queue is copied into
+ * the buffers of the output at the end of each batch, and a flush has the
+ * output write what it holds.
+ */
+struct pcap_writer {
+	int fd;
+	int err;
+	__u32 snaplen;
+	unsigned int flags;
+	unsigned int nifaces;
+	struct psample_pcap_opts opts;
+	struct pcap_writer_rec recs[PCAP_WRITER_RECS];
+	struct iovec iovs[1 + 3 * PCAP_WRITER_RECS];
+	unsigned int nrecs;
+	size_t queued;
+	char *stage;
+	size_t stage_len;
+	size_t stage_size;
+	struct pcap_direct *direct;
+	size_t direct_len;		/* held by it since the last flush */
+	struct timespec last_flush;
+};
+
+/* Write all of the iovecs, which are consumed in the process */
+static int pcap_writer_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int pcap_writer_out(struct pcap_writer *w, struct iovec *iov,
+			   int iovcnt)
+{
+	if (w->direct)
+		return pcap_direct_write(w->direct, iov, iovcnt);
+
+	return pcap_writer_writev(w->fd, iov, iovcnt);
+}
+
+/* Hand the staging buffer and the queue to the output */
+static int pcap_writer_drain(struct pcap_writer *w)
+{
+	if (w->err)
+		return w->err;
+
+	w->iovs[0].iov_base = w->stage;
+	w->iovs[0].iov_len = w->stage_len;
+	w->err = pcap_writer_out(w, w->iovs, 1 + 3 * w->nrecs);
+
+	if (w->direct)
+		w->direct_len += w->queued;
+	w->stage_len = 0;
+	w->nrecs = 0;
+	w->queued = 0;
+	return w->err;
+}
+
+int pcap_writer_flush(struct pcap_writer *w)
+{
+	if (w->err)
+		return w->err;
+	if (!w->stage_len && !w->nrecs && !w->direct_len)
+		return 0;
+
+	if (!pcap_writer_drain(w) && w->direct)
+		w->err = pcap_direct_sync(w->direct);
+
+	w->direct_len = 0;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &w->last_flush);
+	return w->err;
+}
+
+/* The scratch of the next record, or NULL if the writer failed */
+static struct pcap_writer_rec *pcap_writer_rec_get(struct pcap_writer *w)
+{
+	if (w->nrecs == PCAP_WRITER_RECS)
+		pcap_writer_drain(w);
+	if (w->err)
+		return NULL;
+
+	return &w->recs[w->nrecs];
+}
+
+static void pcap_writer_rec_queue(struct pcap_writer *w, size_t hdr_len,
+				  const void *data, size_t data_len,
+				  size_t tail_len)
+{
+	struct pcap_writer_rec *rec = &w->recs[w->nrecs];
+	struct iovec *iov = &w->iovs[1 + 3 * w->nrecs];
+
+	iov[0].iov_base = rec->hdr;
+	iov[0].iov_len = hdr_len;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = data_len;
+	iov[2].iov_base = rec->tail;
+	iov[2].iov_len = tail_len;
+
+	w->nrecs++;
+	w->queued += hdr_len + data_len + tail_len;
+}
+
+static size_t pcapng_opt_put(__u8 *buf, __u16 code, const void *val,
+			     __u16 len)
+{
+	struct pcapng_opt opt = {
+		.code = code,
+		.len = len,
+	};
+
+	memcpy(buf, &opt, sizeof(opt));
+	if (len)
+		memcpy(buf + sizeof(opt), val, len);
+	memset(buf + sizeof(opt) + len, 0, PCAPNG_ALIGN(len) - len);
+	return sizeof(opt) + PCAPNG_ALIGN(len);
+}
+
+/* Close a block of len bytes at buf with the end of options and its length.
+ * Returns the length of the block.
+ */
+static size_t pcapng_block_end(__u8 *buf, size_t len, size_t total_len)
+{
+	__u32 block_len;
+
+	len += pcapng_opt_put(buf + len, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	block_len = total_len + len + sizeof(block_len);
+	memcpy(buf + len, &block_len, sizeof(block_len));
+	return len + sizeof(block_len);
+}
+
+/* A custom option with binary data, to be passed in pkt->opts. Returns its
+ * length, at most 8 bytes more than len, or 0 if it does not fit in size.
+ */
+size_t pcap_writer_opt_custom(void *buf, size_t size, __u32 pen,
+			      const void *val, __u16 len)
+{
+	struct pcapng_opt opt = {
+		.code = PCAPNG_OPT_CUSTOM_BIN,
+		.len = sizeof(pen) + len,
+	};
+	__u8 *p = buf;
+
+	if (size < sizeof(opt) + PCAPNG_ALIGN(sizeof(pen) + (size_t)len))
+		return 0;
+
+	memcpy(p, &opt, sizeof(opt));
+	memcpy(p + sizeof(opt), &pen, sizeof(pen));
+	memcpy(p + sizeof(opt) + sizeof(pen), val, len);
+	memset(p + sizeof(opt) + opt.len, 0, PCAPNG_ALIGN(opt.len) - opt.len);
+	return sizeof(opt) + PCAPNG_ALIGN(opt.len);
+}
+
+/* Returns the id of the interface, or -errno */
+int pcap_writer_add_iface(struct pcap_writer *w, __u16 linktype,
+			  const char *name, const char *description)
+{
+	struct pcapng_idb idb = {
+		.type = PCAPNG_BLOCK_IDB,
+		.linktype = linktype,
+		.snaplen = w->snaplen,
+	};
+	struct pcap_writer_rec *rec;
+	__u8 tsresol = 9;
+	size_t len;
+
+	if (w->opts.format != PSAMPLE_PCAP_FORMAT_PCAPNG)
+		return -EOPNOTSUPP;
+	if ((name && strlen(name) > 32) ||
+	    (description && strlen(description) > 32))
+		return -EINVAL;
+
+	rec = pcap_writer_rec_get(w);
+	if (!rec)
+		return w->err;
+
+	len = sizeof(idb);
+	if (name)
+		len += pcapng_opt_put(rec->hdr + len, PCAPNG_IF_NAME, name,
+				      strlen(name));
+	if (description)
+		len += pcapng_opt_put(rec->hdr + len, PCAPNG_IF_DESCRIPTION,
+				      description, strlen(description));
+	len += pcapng_opt_put(rec->hdr + len, PCAPNG_IF_TSRESOL, &tsresol,
+			      sizeof(tsresol));
+	len = pcapng_block_end(rec->hdr, len, 0);
+
+	idb.total_len = len;
+	memcpy(rec->hdr, &idb, sizeof(idb));
+	pcap_writer_rec_queue(w, len, NULL, 0, 0);
+	return w->nifaces++;
+}
+
+static void pcap_writer_add_pcap(struct pcap_writer *w,
+				 struct pcap_writer_rec *rec,
+				 const struct pcap_writer_pkt *pkt,
+				 size_t data_len)
+{
+	struct pcap_writer_pkthdr hdr = {
+		.ts_sec = pkt->ts / 1000000000,
+		.ts_frac = w->flags & PCAP_WRITER_NSEC ?
+			   pkt->ts % 1000000000 :
+			   pkt->ts % 1000000000 / 1000,
+		.caplen = pkt->link_hdr_len + data_len,
+		.len = pkt->link_hdr_len + pkt->orig_len,
+	};
+
+	memcpy(rec->hdr, &hdr, sizeof(hdr));
+	memcpy(rec->hdr + sizeof(hdr), pkt->link_hdr, pkt->link_hdr_len);
+	pcap_writer_rec_queue(w, sizeof(hdr) + pkt->link_hdr_len, pkt->data,
+			      data_len, 0);
+}
+
+static void pcap_writer_add_pcapng(struct pcap_writer *w,
+				   struct pcap_writer_rec *rec,
+				   const struct pcap_writer_pkt *pkt,
+				   size_t data_len)
+{
+	struct pcapng_epb epb = {
+		.type = PCAPNG_BLOCK_EPB,
+		.iface = pkt->iface,
+		.ts_high = pkt->ts >> 32,
+		.ts_low = pkt->ts,
+		.caplen = pkt->link_hdr_len + data_len,
+		.orig_len = pkt->link_hdr_len + pkt->orig_len,
+	};
+	size_t pad = PCAPNG_ALIGN(epb.caplen) - epb.caplen;
+	size_t tail_len;
+
+	memset(rec->tail, 0, pad);
+	memcpy(rec->tail + pad, pkt->opts, pkt->opts_len);
+	tail_len = pcapng_block_end(rec->tail, pad + pkt->opts_len,
+				    sizeof(epb) + epb.caplen);
+
+	epb.total_len = sizeof(epb) + epb.caplen + tail_len;
+	memcpy(rec->hdr, &epb, sizeof(epb));
+	memcpy(rec->hdr + sizeof(epb), pkt->link_hdr, pkt->link_hdr_len);
+	pcap_writer_rec_queue(w, sizeof(epb) + pkt->link_hdr_len, pkt->data,
+			      data_len, tail_len);
+}
+
+/* Queue a record. Its data must stay where it is until the end of the batch,
+ * the rest is copied.
+ */
+int pcap_writer_add(struct pcap_writer *w, const struct pcap_writer_pkt *pkt)
+{
+	struct pcap_writer_rec *rec;
+	size_t data_len = pkt->data_len;
+
+	if (pkt->link_hdr_len > PCAP_WRITER_LINK_HDR_MAX ||
+	    pkt->opts_len > PCAP_WRITER_OPTS_MAX)
+		return -EINVAL;
+
+	rec = pcap_writer_rec_get(w);
+	if (!rec)
+		return w->err;
+
+	if (w->snaplen && pkt->link_hdr_len + data_len > w->snaplen)
+		data_len = w->snaplen - pkt->link_hdr_len;
+
+	if (w->opts.format == PSAMPLE_PCAP_FORMAT_PCAPNG)
+		pcap_writer_add_pcapng(w, rec, pkt, data_len);
+	else
+		pcap_writer_add_pcap(w, rec, pkt, data_len);
+	return 0;
+}
+
+static bool pcap_writer_flush_due(struct pcap_writer *w)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	switch (w->opts.flush) {
+	case PSAMPLE_PCAP_FLUSH_IMMEDIATE:
+		return true;
+	case PSAMPLE_PCAP_FLUSH_BYTES:
+		return w->stage_len + w->direct_len + w->queued >=
+		       w->opts.flush_bytes;
+	case PSAMPLE_PCAP_FLUSH_INTERVAL:
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		elapsed_ms = (now.tv_sec - w->last_flush.tv_sec) * 1000 +
+			     (now.tv_nsec - w->last_flush.tv_nsec) / 1000000;
+		return elapsed_ms >= w->opts.flush_ms;
+	case PSAMPLE_PCAP_FLUSH_FULL:
+		break;
+	}
+
+	return false;
+}
+
+/* Milliseconds until the interval of the flush policy is up for the records
+ * held, to wait for the next batch at most that long and flush, or -1 if
+ * nothing needs flushing without further records.
+ */
+int pcap_writer_flush_timeout(struct pcap_writer *w)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	if (w->err || w->opts.flush != PSAMPLE_PCAP_FLUSH_INTERVAL ||
+	    (!w->stage_len && !w->nrecs && !w->direct_len))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	elapsed_ms = (now.tv_sec - w->last_flush.tv_sec) * 1000 +
+		     (now.tv_nsec - w->last_flush.tv_nsec) / 1000000;
+	if (elapsed_ms >= w->opts.flush_ms)
+		return 0;
+	return w->opts.flush_ms - elapsed_ms;
+}
+
+/* The data of the queued records may be reused after this */
+int pcap_writer_batch_end(struct pcap_writer *w)
+{
+	unsigned int i;
+
+	if (w->err)
+		return w->err;
+	if (!w->nrecs)
+		return 0;
+
+	if (pcap_writer_flush_due(w))
+		return pcap_writer_flush(w);
+	if (w->direct)
+		return pcap_writer_drain(w);
+	if (w->stage_len + w->queued > w->stage_size)
+		return pcap_writer_flush(w);
+
+	for (i = 1; i <= 3 * w->nrecs; i++) {
+		memcpy(w->stage + w->stage_len, w->iovs[i].iov_base,
+		       w->iovs[i].iov_len);
+		w->stage_len += w->iovs[i].iov_len;
+	}
+	w->nrecs = 0;
+	w->queued = 0;
+	return 0;
+}
+
+static size_t pcap_writer_file_hdr(const struct pcap_writer *w, __u8 *buf,
+				   __u32 linktype)
+{
+	struct pcap_writer_file_hdr hdr = {
+		.magic = w->flags & PCAP_WRITER_NSEC ?
+			 PCAP_WRITER_MAGIC_NSEC : PCAP_WRITER_MAGIC,
+		.version_major = PCAP_WRITER_VERSION_MAJOR,
+		.version_minor = PCAP_WRITER_VERSION_MINOR,
+		.snaplen = w->snaplen,
+		.linktype = linktype,
+	};
+	struct pcapng_shb shb = {
+		.type = PCAPNG_BLOCK_SHB,
+		.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC,
+		.version_major = 1,
+		.version_minor = 0,
+		.section_len = -1,
+	};
+	static const char userappl[] = "libpsample";
+	size_t len;
+
+	if (w->opts.format != PSAMPLE_PCAP_FORMAT_PCAPNG) {
+		memcpy(buf, &hdr, sizeof(hdr));
+		return sizeof(hdr);
+	}
+
+	len = sizeof(shb);
+	len += pcapng_opt_put(buf + len, PCAPNG_SHB_USERAPPL, userappl,
+			      sizeof(userappl) - 1);
+	len = pcapng_block_end(buf, len, 0);
+	shb.total_len = len;
+	memcpy(buf, &shb, sizeof(shb));
+	return len;
+}
+
+struct pcap_writer *pcap_writer_open(int fd,
+				     const struct psample_pcap_opts *opts,
+				     __u32 linktype, __u32 snaplen,
+				     unsigned int flags)
+{
+	__u8 hdr[PCAP_WRITER_HDR_MAX];
+	struct iovec iov;
+	struct pcap_writer *w;
+	int err;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->fd = fd;
+	w->snaplen = snaplen;
+	w->flags = flags;
+	w->opts = *opts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &w->last_flush);
+
+	/* Records are never held past their batch when flushing each time,
+	 * and a direct output has buffers of its own.
+	 */
+	if (opts->io == PSAMPLE_PCAP_IO_URING_DIRECT) {
+		w->direct = pcap_direct_open(fd, opts->buf_size,
+					     opts->io_depth, opts->prealloc);
+		if (!w->direct)
+			goto err_free;
+	} else if (opts->flush != PSAMPLE_PCAP_FLUSH_IMMEDIATE) {
+		w->stage_size = opts->buf_size ? opts->buf_size :
+						 PCAP_WRITER_STAGE_SIZE;
+		w->stage = malloc(w->stage_size);
+		if (!w->stage)
+			goto err_free;
+	}
+
+	iov.iov_base = hdr;
+	iov.iov_len = pcap_writer_file_hdr(w, hdr, linktype);
+	err = pcap_writer_out(w, &iov, 1);
+	if (err) {
+		if (w->direct)
+			pcap_direct_close(w->direct);
+		free(w->stage);
+		free(w);
+		errno = -err;
+		return NULL;
+	}
+	if (w->direct)
+		w->direct_len = iov.iov_len;
+
+	return w;
+
+err_free:
+	err = errno;
+	free(w->stage);
+	free(w);
+	errno = err;
+	return NULL;
+}
+
+/* Flush what is left and free the writer, the fd is left open */
+int pcap_writer_close(struct pcap_writer *w)
+{
+	int err;
+
+	err = pcap_writer_flush(w);
+	if (w->direct) {
+		int close_err = pcap_direct_close(w->direct);
+
+		if (!err)
+			err = close_err;
+	}
+	free(w->stage);
+	free(w);
+	return err;
+}
@@ -0,0 +1,67 @@
+/*
+ *   pcap_writer.h	Zero-copy pcap and pcapng file writer
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _PCAP_WRITER_H_
+#define _PCAP_WRITER_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <linux/types.h>
+#include <psample.h>
+
+#define PCAP_WRITER_LINKTYPE_ETHERNET	1
+#define PCAP_WRITER_LINKTYPE_NETLINK	253
+
+/* Longest link layer header put in front of the data of a record */
+#define PCAP_WRITER_LINK_HDR_MAX	16
+
+/* Longest pcapng options of a packet, end of options excluded */
+#define PCAP_WRITER_OPTS_MAX		224
+
+/* Nanosecond timestamps in a pcap file, pcapng ones always are */
+#define PCAP_WRITER_NSEC		(1 << 0)
+
+struct pcap_writer;
+
+struct pcap_writer_pkt {
+	__u64 ts;			/* nanoseconds since the epoch */
+	__u32 iface;			/* pcapng only */
+	const void *link_hdr;		/* copied in front of the data */
+	size_t link_hdr_len;
+	const void *data;		/* written from where it is */
+	size_t data_len;
+	size_t orig_len;		/* of the data on the wire */
+	const void *opts;		/* pcapng only, pcap_writer_opt_*() */
+	size_t opts_len;
+};
+
+/* The format is the one of opts. The link type and snaplen are the ones of
+ * the pcap file header, a pcapng file gets its interfaces from
+ * pcap_writer_add_iface() instead. A zero snaplen does not cut records.
+ */
+struct pcap_writer *pcap_writer_open(int fd,
+				     const struct psample_pcap_opts *opts,
+				     __u32 linktype, __u32 snaplen,
+				     unsigned int flags);
+int pcap_writer_add_iface(struct pcap_writer *w, __u16 linktype,
+			  const char *name, const char *description);
+int pcap_writer_add(struct pcap_writer *w, const struct pcap_writer_pkt *pkt);
+size_t pcap_writer_opt_custom(void *buf, size_t size, __u32 pen,
+			      const void *val, __u16 len);
+int pcap_writer_batch_end(struct pcap_writer *w);
+int pcap_writer_flush(struct pcap_writer *w);
+int pcap_writer_flush_timeout(struct pcap_writer *w);
+int pcap_writer_close(struct pcap_writer *w);
+
+static inline __u64 pcap_writer_ts(const struct timespec *ts)
+{
+	return (__u64)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+#endif /* _PCAP_WRITER_H_ */
@@ -32,19 +32,29 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
-#include <pcap/pcap.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
 #include <libmnl/libmnl.h>
 #include <linux/psample.h>
 #include <linux/genetlink.h>
 #include <linux/filter.h>
 #include <linux/if_arp.h>
+#include <linux/sock_diag.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <endian.h>
 #include <psample.h>
 #include "mnlg.h"
+#include "filter.h"
+#include "pcap_writer.h"
+#include "spsc_ring.h"
 
 #define LOG(level, ...) \
 		psample_log(level, __FILE__, __LINE__, __func__, __VA_ARGS__)
@@ -59,12 +69,23 @@
 static void logfn_stderr(enum psample_log_level level, const char *file,
 			 int line, const char *fn, const char *format,
 			 va_list args);
+static int psample_attrs_parse(const struct nlmsghdr *nlhdr, __u32 fields,
+			       struct nlattr **tb, __u32 *data_len);
+static int psample_keep_switch_collect(struct psample_handle *handle,
+				       bool wait);
 
 enum psample_log_level psample_loglevel = PSAMPLE_LOG_WARN;
 logfn psample_logfunc = logfn_stderr;
 
 struct psample_msg {
+	const struct nlmsghdr *nlh;
 	struct nlattr **tb;
+	__u32 data_len;
+	double keep;
+	int flow_err;		/* 1 until psample_msg_flow() is called */
+	struct psample_flow_key flow;
+	bool tunnel_parsed;	/* by psample_msg_tunnel_get() */
+	struct psample_tunnel_key tunnel;
 };
 
 struct psample_config {
@@ -72,17 +93,89 @@ struct psample_config {
 	struct nlattr **tb;
 };
 
+/* Based on https://www.tcpdump.org/linktypes/LINKTYPE_LINUX_SLL.html */
+struct linux_sll {
+	__be16 pkttype;
+	__be16 hatype;
+	__be16 halen;
+	unsigned char addr[8];
+	__be16 family;
+};
+
+/* A pcapng interface, samples of a group received on a port */
+struct psample_pcap_iface {
+	__u32 group;
+	__u32 ifindex;
+};
+
+/* A receive buffer of the ring, handed to the writer thread */
+struct psample_pcap_slot {
+	__u64 ts;		/* received, nanoseconds since the epoch */
+	__u32 len;		/* 0 for a datagram to skip */
+	__u32 reserved;
+	char buf[];		/* MNL_SOCKET_BUFFER_SIZE bytes */
+};
+
+/* The counters of struct psample_pcap_stats, updated by the receiver while
+ * psample_pcap_get_stats() may read them from another thread.
+ */
+struct psample_pcap_counters {
+	_Atomic __u32 ring_max_used;
+	_Atomic __u64 ring_stalls;
+	_Atomic __u64 ring_stall_usec;
+	_Atomic __u64 ring_drops;
+};
+
 struct psample_pcap {
-	long snaplen;
-	char *pcap_buf;
-	pcap_t *pcap_handle;
-	pcap_dumper_t *pcap_dumper;
+	struct pcap_writer *writer;
+	int fd;
+	enum psample_pcap_format format;
+	struct linux_sll sll;
+	struct psample_pcap_iface *ifaces;	/* by pcapng interface id */
+	unsigned int nifaces;
+	struct spsc_ring ring;			/* slots is NULL when unused */
+	enum psample_pcap_ring_overflow ring_overflow;
+	int ring_err;				/* of the writer thread */
+	struct psample_pcap_counters stats;
+};
+
+/* Adaptive load shedding state, see psample_set_keep_auto() */
+struct psample_shed {
+	bool enabled;
+	double min_keep;
+	struct timespec last_update;
+	__u64 last_drops;
+};
+
+struct psample_group_seq {
+	__u32 group;
+	__u32 seq;
+};
+
+/* A change of the keep fraction. Samples already queued when the new filter
+ * was attached were accepted with old_keep: those of each group with a
+ * sequence number below the one the group had right after.
+ */
+struct psample_keep_switch {
+	double old_keep;
+	struct psample_group_seq *groups;
+	unsigned int ngroups;
 };
 
+/* The last changes, older samples are long received */
+#define PSAMPLE_KEEP_SWITCHES 4
+
 struct psample_handle {
 	struct mnlg_socket *sample_nlh;
 	struct mnlg_socket *control_nlh;
 	struct sock_fprog sample_filter_fprog;
+	struct filter_opts filter_opts;
+	struct psample_shed shed;
+	struct psample_keep_switch keep_switches[PSAMPLE_KEEP_SWITCHES];
+	unsigned int keep_nswitches;
+	unsigned int keep_switch_next;		/* the oldest when full */
+	bool keep_switch_pending;		/* its group dump not all read */
+	__u32 fields;
 	struct psample_pcap psample_pcap;
 };
 
@@ -138,57 +231,236 @@ void psample_log(enum psample_log_level level,
 	va_end(args);
 }
 
+/* Build the sample socket filter from handle->filter_opts and attach it. The
+ * new filter replaces the old one atomically, so no message is let through
+ * unfiltered in between.
+ */
+static int psample_filter_apply(struct psample_handle *handle)
+{
+	struct sock_fprog *fprog = &handle->sample_filter_fprog;
+	struct sock_fprog new_fprog;
+	int err;
+	int fd;
+
+	fd = mnlg_socket_get_fd(handle->sample_nlh);
+
+	if (!filter_needed(&handle->filter_opts)) {
+		if (!fprog->filter)
+			return 0;
+
+		err = setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER,
+				 fprog, sizeof(*fprog));
+		if (err) {
+			LOG_ERR("Could not detach filter prog: %s",
+				strerror(errno));
+			return -errno;
+		}
+
+		free(fprog->filter);
+		fprog->filter = NULL;
+		fprog->len = 0;
+		return 0;
+	}
+
+	err = filter_build(&handle->filter_opts, &new_fprog);
+	if (err) {
+		LOG_ERR("Could not build filter prog: %s", strerror(-err));
+		return err;
+	}
+
+	err = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &new_fprog,
+			 sizeof(new_fprog));
+	if (err) {
+		err = -errno;
+		LOG_ERR("Could not attach filter prog: %s", strerror(errno));
+		free(new_fprog.filter);
+		return err;
+	}
+
+	free(fprog->filter);
+	*fprog = new_fprog;
+	return 0;
+}
+
+static int psample_socket_opts_set(struct mnlg_socket *nlg,
+				   const struct psample_open_opts *opts)
+{
+	int fd = mnlg_socket_get_fd(nlg);
+	int optval;
+	int err;
+
+	if (opts->rcvbuf) {
+		optval = opts->rcvbuf;
+		err = setsockopt(fd, SOL_SOCKET,
+				 opts->rcvbuf_force ? SO_RCVBUFFORCE : SO_RCVBUF,
+				 &optval, sizeof(optval));
+		if (err) {
+			LOG_ERR("Could not set receive buffer size to %d: %s",
+				optval, strerror(errno));
+			return -errno;
+		}
+	}
+
+	if (opts->no_enobufs) {
+		optval = 1;
+		err = setsockopt(fd, SOL_NETLINK, NETLINK_NO_ENOBUFS,
+				 &optval, sizeof(optval));
+		if (err) {
+			LOG_ERR("Could not set NETLINK_NO_ENOBUFS: %s",
+				strerror(errno));
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/* Twice the batch size, so the kernel has buffers to fill while a batch is
+ * being handled.
+ */
+static unsigned int psample_uring_entries(const struct psample_open_opts *opts)
+{
+	unsigned int entries = 64;
+
+	if (opts->uring_entries)
+		return opts->uring_entries;
+
+	while (entries < 2 * opts->batch_size && entries < 32768)
+		entries <<= 1;
+	return entries;
+}
+
 struct psample_handle *psample_open()
 {
+	return psample_open_ext(NULL);
+}
+
+struct psample_handle *psample_open_ext(const struct psample_open_opts *opts)
+{
+	struct psample_open_opts default_opts = {};
 	struct psample_handle *handle;
 	int err;
 
+	if (!opts)
+		opts = &default_opts;
+
+	if (opts->shard_count > 1 && opts->shard_index >= opts->shard_count) {
+		LOG_ERR("Invalid shard %u of %u", opts->shard_index,
+			opts->shard_count);
+		return NULL;
+	}
+
 	handle = (struct psample_handle *)calloc(sizeof(*handle), 1);
 	if (!handle) {
 		LOG_ERR("Could not allocate memory");
 		return NULL;
 	}
 
+	handle->filter_opts.snaplen = -1;
+	handle->filter_opts.keep = 1;
+	handle->fields = PSAMPLE_FIELD_ALL;
+	handle->filter_opts.shard_count = opts->shard_count;
+	handle->filter_opts.shard_index = opts->shard_index;
+
 	handle->sample_nlh = mnlg_socket_open(PSAMPLE_GENL_NAME,
 					      PSAMPLE_GENL_VERSION);
 	if (!handle->sample_nlh) {
 		LOG_ERR("Could not open netlink socket");
-		free(handle);
-		return NULL;
+		goto err_sample_open;
 	}
 
+	err = psample_socket_opts_set(handle->sample_nlh, opts);
+	if (err < 0)
+		goto err_sample_setup;
+
 	err = mnlg_socket_group_add(handle->sample_nlh,
 				    PSAMPLE_NL_MCGRP_CONFIG_NAME);
 	if (err < 0) {
 		LOG_ERR("Could not bind to config multicast group");
-		mnlg_socket_close(handle->sample_nlh);
-		free(handle);
-		return NULL;
+		goto err_sample_setup;
 	}
 
 	err = mnlg_socket_group_add(handle->sample_nlh,
 				    PSAMPLE_NL_MCGRP_SAMPLE_NAME);
 	if (err < 0) {
 		LOG_ERR("Could not bind to sample multicast group");
-		mnlg_socket_close(handle->sample_nlh);
-		free(handle);
-		return NULL;
+		goto err_sample_setup;
+	}
+
+	/* Joining a group looks it up on the socket, so the shard filter is
+	 * only attached once the replies are read.
+	 */
+	handle->filter_opts.family = handle->sample_nlh->id;
+	err = psample_filter_apply(handle);
+	if (err < 0)
+		goto err_sample_setup;
+
+	err = mnlg_socket_batch_set(handle->sample_nlh,
+				    opts->batch_size ? opts->batch_size : 1);
+	if (err < 0) {
+		LOG_ERR("Could not allocate receive batch");
+		goto err_sample_setup;
+	}
+
+	if (opts->recv_backend == PSAMPLE_RECV_IO_URING) {
+		err = mnlg_socket_uring_enable(handle->sample_nlh,
+					       psample_uring_entries(opts));
+		if (err < 0)
+			LOG_INFO("io_uring receive not available (%s), using recvmmsg",
+				 strerror(errno));
 	}
 
 	handle->control_nlh = mnlg_socket_open(PSAMPLE_GENL_NAME,
 					       PSAMPLE_GENL_VERSION);
 	if (!handle->control_nlh) {
 		LOG_ERR("Could not open control nlsock");
-		mnlg_socket_close(handle->sample_nlh);
-		free(handle);
-		return NULL;
+		goto err_sample_setup;
 	}
 
 	return handle;
+
+err_sample_setup:
+	mnlg_socket_close(handle->sample_nlh);
+	free(handle->sample_filter_fprog.filter);
+err_sample_open:
+	free(handle);
+	return NULL;
+}
+
+int psample_open_shards(const struct psample_open_opts *opts,
+			unsigned int count, struct psample_handle **handles)
+{
+	struct psample_open_opts shard_opts = {};
+	unsigned int i;
+
+	if (!count || !handles) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
+
+	if (opts)
+		shard_opts = *opts;
+	shard_opts.shard_count = count;
+
+	for (i = 0; i < count; i++) {
+		shard_opts.shard_index = i;
+		handles[i] = psample_open_ext(&shard_opts);
+		if (!handles[i])
+			goto err_open;
+	}
+
+	return 0;
+
+err_open:
+	while (i--)
+		psample_close(handles[i]);
+	return -ENODEV;
 }
 
 void psample_close(struct psample_handle *handle)
 {
+	unsigned int i;
+
 	if (!handle)
 		return;
 
@@ -197,69 +469,283 @@ void psample_close(struct psample_handle *handle)
 
 	if (handle->sample_filter_fprog.filter)
 		free(handle->sample_filter_fprog.filter);
+	free(handle->filter_opts.groups);
+	for (i = 0; i < PSAMPLE_KEEP_SWITCHES; i++)
+		free(handle->keep_switches[i].groups);
 	free(handle);
 }
 
-/* Based on https://www.tcpdump.org/linktypes/LINKTYPE_LINUX_SLL.html */
-struct linux_sll {
-	__be16 pkttype;
-	__be16 hatype;
-	__be16 halen;
-	unsigned char addr[8];
-	__be16 family;
-};
+int psample_set_batch_size(struct psample_handle *handle, unsigned int size)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return -EINVAL;
+	}
+
+	if (mnlg_socket_batch_set(handle->sample_nlh, size) < 0) {
+		LOG_ERR("Could not set batch size %u: %s", size,
+			strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
 
-static int psample_pcap_buf_init(struct psample_handle *handle)
+unsigned int psample_get_batch_size(struct psample_handle *handle)
 {
-	struct linux_sll sll;
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return 0;
+	}
 
-	/* The wireshark netlink dissector expects netlink messages to start
-	 * with a Linux cooked header (SLL), so include it before each packet.
-	 */
-	memset(&sll, 0, sizeof(sll));
-	sll.pkttype = htons(PACKET_OUTGOING);
-	sll.hatype = htons(ARPHRD_NETLINK);
-	sll.family = htons(AF_NETLINK);
-
-	handle->psample_pcap.pcap_buf = calloc(1, handle->psample_pcap.snaplen);
-	if (!handle->psample_pcap.pcap_buf) {
-		perror("calloc failed");
-		return -1;
+	return handle->sample_nlh->batch.size;
+}
+
+/* The kernel counts every message it could not queue in SK_MEMINFO_DROPS,
+ * including the ones dropped silently when NETLINK_NO_ENOBUFS is set.
+ */
+static int psample_meminfo_get(struct psample_handle *handle,
+			       __u32 meminfo[SK_MEMINFO_VARS])
+{
+	socklen_t len = SK_MEMINFO_VARS * sizeof(meminfo[0]);
+	int fd;
+
+	memset(meminfo, 0, len);
+	fd = mnlg_socket_get_fd(handle->sample_nlh);
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len))
+		return -errno;
+
+	return 0;
+}
+
+int psample_get_stats(struct psample_handle *handle,
+		      struct psample_stats *stats)
+{
+	__u32 meminfo[SK_MEMINFO_VARS];
+
+	if (!handle || !stats) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
 	}
 
-	memcpy(handle->psample_pcap.pcap_buf, &sll, sizeof(sll));
+	memset(stats, 0, sizeof(*stats));
+	stats->recv_calls = handle->sample_nlh->stats.recv_calls;
+	stats->recv_msgs = handle->sample_nlh->stats.recv_msgs;
+	stats->overruns = handle->sample_nlh->stats.overruns;
+
+	if (!psample_meminfo_get(handle, meminfo))
+		stats->drops = meminfo[SK_MEMINFO_DROPS];
 
 	return 0;
 }
 
-static void psample_pcap_buf_fini(struct psample_handle *handle)
+/* The time a batch is received, which its records are stamped with */
+static __u64 psample_pcap_recv_ts(void)
 {
-	free(handle->psample_pcap.pcap_buf);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return pcap_writer_ts(&ts);
 }
 
-static void psample_pcap_write(void *data, unsigned char *buf, int len)
+/* The netlink message at buf is written from the receive buffer, so it must
+ * stay there until pcap_writer_batch_end().
+ */
+static void psample_pcap_write(struct psample_handle *handle,
+			       const void *buf, int len, __u64 ts)
 {
-	struct psample_handle *handle = data;
-	struct pcap_pkthdr hdr;
-	int pkt_len;
+	struct pcap_writer_pkt pkt = {
+		.ts = ts,
+		.link_hdr = &handle->psample_pcap.sll,
+		.link_hdr_len = sizeof(handle->psample_pcap.sll),
+		.data = buf,
+		.data_len = len,
+		.orig_len = len,
+	};
+
+	pcap_writer_add(handle->psample_pcap.writer, &pkt);
+}
 
-	if (len + sizeof(struct linux_sll) < handle->psample_pcap.snaplen)
-		pkt_len = len + sizeof(struct linux_sll);
-	else
-		pkt_len = handle->psample_pcap.snaplen - sizeof(struct linux_sll);
+/* The pcapng interface id of the samples of group received on ifindex. The
+ * interface is described the first time it is seen.
+ */
+static int psample_pcapng_iface(struct psample_pcap *pcap, __u32 group,
+				__u32 ifindex)
+{
+	struct psample_pcap_iface *ifaces;
+	char name[IF_NAMESIZE];
+	char description[32];
+	unsigned int i;
+	int id;
+
+	for (i = 0; i < pcap->nifaces; i++)
+		if (pcap->ifaces[i].group == group &&
+		    pcap->ifaces[i].ifindex == ifindex)
+			return i;
+
+	ifaces = realloc(pcap->ifaces, (pcap->nifaces + 1) * sizeof(*ifaces));
+	if (!ifaces)
+		return -ENOMEM;
+	pcap->ifaces = ifaces;
+
+	snprintf(description, sizeof(description), "psample group %u iif %u",
+		 group, ifindex);
+	id = pcap_writer_add_iface(pcap->writer, PCAP_WRITER_LINKTYPE_ETHERNET,
+				   ifindex && if_indextoname(ifindex, name) ?
+				   name : NULL, description);
+	if (id < 0)
+		return id;
+
+	ifaces[id].group = group;
+	ifaces[id].ifindex = ifindex;
+	pcap->nifaces++;
+	return id;
+}
 
-	memcpy(handle->psample_pcap.pcap_buf + sizeof(struct linux_sll), buf, pkt_len);
+/* The packet of a sample, timestamped by the kernel when it can be or else
+ * with the time it was received, ts, and its length on the wire.
+ */
+static void psample_pcap_sample_pkt(struct nlattr **tb, __u32 data_len,
+				    __u64 ts, struct pcap_writer_pkt *pkt)
+{
+	pkt->ts = tb[PSAMPLE_ATTR_TIMESTAMP] ?
+		  mnl_attr_get_u64(tb[PSAMPLE_ATTR_TIMESTAMP]) : ts;
+
+	if (tb[PSAMPLE_ATTR_DATA])
+		pkt->data = mnl_attr_get_payload(tb[PSAMPLE_ATTR_DATA]);
+	pkt->data_len = data_len;
+	pkt->orig_len = tb[PSAMPLE_ATTR_ORIGSIZE] ?
+			mnl_attr_get_u32(tb[PSAMPLE_ATTR_ORIGSIZE]) : data_len;
+}
 
-	hdr.caplen = pkt_len;
-	hdr.len = pkt_len;
-	gettimeofday(&hdr.ts, NULL);
+/* The metadata written as pcapng options. attr_cb() checks their length, so
+ * their options take at most 20 bytes each and fit in PCAP_WRITER_OPTS_MAX.
+ */
+static const int psample_pcapng_attrs[] = {
+	PSAMPLE_ATTR_SAMPLE_GROUP,
+	PSAMPLE_ATTR_GROUP_SEQ,
+	PSAMPLE_ATTR_SAMPLE_RATE,
+	PSAMPLE_ATTR_ORIGSIZE,
+	PSAMPLE_ATTR_IIFINDEX,
+	PSAMPLE_ATTR_OIFINDEX,
+	PSAMPLE_ATTR_OUT_TC,
+	PSAMPLE_ATTR_OUT_TC_OCC,
+	PSAMPLE_ATTR_LATENCY,
+	PSAMPLE_ATTR_TIMESTAMP,
+	PSAMPLE_ATTR_PROTO,
+};
 
-	pcap_dump((unsigned char *) handle->psample_pcap.pcap_dumper, &hdr,
-		  (const unsigned char *) handle->psample_pcap.pcap_buf);
-	/* In case packets are written to stdout, make sure each packet is
-	 * immediately written and not buffered.
-	 */
-	fflush(NULL);
+/* Write the packet of a sample, which must stay in the receive buffer until
+ * pcap_writer_batch_end(). Other messages are not written.
+ */
+static void psample_pcapng_write(struct psample_handle *handle,
+				 const struct nlmsghdr *nlh, __u64 ts)
+{
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
+	__u8 opts[PCAP_WRITER_OPTS_MAX];
+	struct pcap_writer_pkt pkt = {};
+	const struct genlmsghdr *genl;
+	__u32 data_len;
+	unsigned int i;
+	int iface;
+
+	if (mnl_nlmsg_get_payload_len(nlh) < sizeof(*genl))
+		return;
+	genl = mnl_nlmsg_get_payload(nlh);
+	if (genl->cmd != PSAMPLE_CMD_SAMPLE)
+		return;
+	if (psample_attrs_parse(nlh, PSAMPLE_FIELD_ALL, tb,
+				&data_len) != MNL_CB_OK)
+		return;
+
+	iface = psample_pcapng_iface(pcap,
+		tb[PSAMPLE_ATTR_SAMPLE_GROUP] ?
+		mnl_attr_get_u32(tb[PSAMPLE_ATTR_SAMPLE_GROUP]) : 0,
+		tb[PSAMPLE_ATTR_IIFINDEX] ?
+		mnl_attr_get_u16(tb[PSAMPLE_ATTR_IIFINDEX]) : 0);
+	if (iface < 0) {
+		LOG_ERR("Could not add a pcapng interface: %s",
+			strerror(-iface));
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(psample_pcapng_attrs); i++) {
+		const struct nlattr *attr = tb[psample_pcapng_attrs[i]];
+
+		if (attr)
+			pkt.opts_len += pcap_writer_opt_custom(
+				opts + pkt.opts_len,
+				sizeof(opts) - pkt.opts_len,
+				PSAMPLE_PCAPNG_PEN, attr, attr->nla_len);
+	}
+
+	psample_pcap_sample_pkt(tb, data_len, ts, &pkt);
+	pkt.iface = iface;
+	pkt.opts = opts;
+	pcap_writer_add(pcap->writer, &pkt);
+}
+
+/* Write the packet of a sample as an Ethernet frame. Only the attributes
+ * needed for that are parsed.
+ */
+static void psample_pcap_packets_write(struct psample_handle *handle,
+				       const struct nlmsghdr *nlh, __u64 ts)
+{
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
+	struct pcap_writer_pkt pkt = {};
+	const struct genlmsghdr *genl;
+	__u32 data_len;
+
+	if (mnl_nlmsg_get_payload_len(nlh) < sizeof(*genl))
+		return;
+	genl = mnl_nlmsg_get_payload(nlh);
+	if (genl->cmd != PSAMPLE_CMD_SAMPLE)
+		return;
+	if (psample_attrs_parse(nlh, PSAMPLE_FIELD_DATA |
+				PSAMPLE_FIELD_ORIGSIZE |
+				PSAMPLE_FIELD_TIMESTAMP, tb,
+				&data_len) != MNL_CB_OK ||
+	    !tb[PSAMPLE_ATTR_DATA])
+		return;
+
+	psample_pcap_sample_pkt(tb, data_len, ts, &pkt);
+	pcap_writer_add(handle->psample_pcap.writer, &pkt);
+}
+
+/* Write each netlink message of the len bytes received at buf, at time ts,
+ * as a record of its own. Returns true if one of them was an ack.
+ */
+static bool psample_pcap_write_msgs(struct psample_handle *handle, void *buf,
+				    int len, __u64 ts)
+{
+	struct nlmsghdr *nlh = buf;
+	bool ack = false;
+
+	while (len >= (int)sizeof(*nlh)) {
+		/* Trimmed by the socket filter */
+		if (nlh->nlmsg_len > len)
+			nlh->nlmsg_len = len;
+		if (!mnl_nlmsg_ok(nlh, len))
+			break;
+
+		switch (handle->psample_pcap.format) {
+		case PSAMPLE_PCAP_FORMAT_PCAP:
+			psample_pcap_write(handle, nlh, nlh->nlmsg_len, ts);
+			break;
+		case PSAMPLE_PCAP_FORMAT_PCAPNG:
+			psample_pcapng_write(handle, nlh, ts);
+			break;
+		case PSAMPLE_PCAP_FORMAT_PACKETS:
+			psample_pcap_packets_write(handle, nlh, ts);
+			break;
+		}
+		if (nlh->nlmsg_type == NLMSG_ERROR)
+			ack = true;
+		nlh = mnl_nlmsg_next(nlh, &len);
+	}
+
+	return ack;
 }
 
 static int psample_pcap_genl_init(struct psample_handle *handle)
@@ -271,284 +757,1469 @@ static int psample_pcap_genl_init(struct psample_handle *handle)
 	 * Reference:
 	 * https://www.wireshark.org/lists/wireshark-users/201907/msg00027.html
 	 */
+	struct mnlg_socket *nlg = handle->control_nlh;
 	struct nlmsghdr *nlh;
+	bool ack;
 	int err;
 
-	nlh = mnlg_msg_prepare(handle->sample_nlh, CTRL_CMD_GETFAMILY,
+	/* The reply comes after any group dump still to be read */
+	psample_keep_switch_collect(handle, true);
+
+	/* Not on the sample socket, whose receive may be an io_uring
+	 * multishot recvmsg, armed already, that would take the reply.
+	 */
+	nlh = mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
 			       NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
 
-	mnl_attr_put_u16(nlh, CTRL_ATTR_FAMILY_ID, handle->sample_nlh->id);
-	err = mnlg_socket_send(handle->sample_nlh, nlh);
+	mnl_attr_put_u16(nlh, CTRL_ATTR_FAMILY_ID, nlg->id);
+	err = mnlg_socket_send(nlg, nlh);
 	if (err < 0)
 		return err;
 
 	do {
-		err = mnl_socket_recvfrom(handle->sample_nlh->nl,
-					  handle->sample_nlh->buf,
+		err = mnl_socket_recvfrom(nlg->nl, nlg->buf,
 					  MNL_SOCKET_BUFFER_SIZE);
 		if (err <= 0)
 			break;
+		ack = psample_pcap_write_msgs(handle, nlg->buf, err,
+					      psample_pcap_recv_ts());
+		err = pcap_writer_batch_end(handle->psample_pcap.writer);
+		if (err) {
+			errno = -err;
+			err = -1;
+		}
+	} while (!err && !ack);
+
+	return err < 0 ? err : 0;
+}
+
+int psample_pcap_init(const char *out_file, struct psample_handle *handle)
+{
+	return psample_pcap_init_opts(out_file, handle, NULL);
+}
+
+int psample_pcap_packets_init(const char *out_file,
+			      struct psample_handle *handle)
+{
+	struct psample_pcap_opts opts = {
+		.flush = PSAMPLE_PCAP_FLUSH_IMMEDIATE,
+		.format = PSAMPLE_PCAP_FORMAT_PACKETS,
+	};
+
+	return psample_pcap_init_opts(out_file, handle, &opts);
+}
+
+int psample_pcap_init_opts(const char *out_file, struct psample_handle *handle,
+			   const struct psample_pcap_opts *opts)
+{
+	struct psample_pcap_opts default_opts = {
+		.flush = PSAMPLE_PCAP_FLUSH_IMMEDIATE,
+	};
+	int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	int err;
+
+	if (!opts)
+		opts = &default_opts;
+
+	/* The wireshark netlink dissector expects netlink messages to start
+	 * with a Linux cooked header (SLL), so include it before each packet.
+	 */
+	memset(&pcap->sll, 0, sizeof(pcap->sll));
+	pcap->sll.pkttype = htons(PACKET_OUTGOING);
+	pcap->sll.hatype = htons(ARPHRD_NETLINK);
+	pcap->sll.family = htons(AF_NETLINK);
+
+	if (opts->io == PSAMPLE_PCAP_IO_URING_DIRECT) {
+		if (!strcmp(out_file, "-")) {
+			fprintf(stderr, "Direct output needs a file\n");
+			return -1;
+		}
+		open_flags |= O_DIRECT;
+	}
+
+	if (!strcmp(out_file, "-"))
+		pcap->fd = STDOUT_FILENO;
+	else
+		pcap->fd = open(out_file, open_flags, 0666);
+	if (pcap->fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	pcap->format = opts->format;
+	pcap->ifaces = NULL;
+	pcap->nifaces = 0;
+	switch (pcap->format) {
+	case PSAMPLE_PCAP_FORMAT_PCAP:
+		pcap->writer = pcap_writer_open(pcap->fd, opts,
+						PCAP_WRITER_LINKTYPE_NETLINK,
+						0xffff, 0);
+		break;
+	case PSAMPLE_PCAP_FORMAT_PCAPNG:
+		pcap->writer = pcap_writer_open(pcap->fd, opts, 0, 0, 0);
+		break;
+	case PSAMPLE_PCAP_FORMAT_PACKETS:
+		pcap->writer = pcap_writer_open(pcap->fd, opts,
+						PCAP_WRITER_LINKTYPE_ETHERNET,
+						0xffff, PCAP_WRITER_NSEC);
+		break;
+	default:
+		errno = EINVAL;
+		pcap->writer = NULL;
+		break;
+	}
+	if (!pcap->writer) {
+		perror("pcap_writer_open");
+		goto err_writer_open;
+	}
+
+	memset(&pcap->stats, 0, sizeof(pcap->stats));
+	memset(&pcap->ring, 0, sizeof(pcap->ring));
+	pcap->ring_overflow = opts->ring_overflow;
+	pcap->ring_err = 0;
+	if (opts->ring_depth) {
+		err = spsc_ring_init(&pcap->ring, opts->ring_depth,
+				     sizeof(struct psample_pcap_slot) +
+				     MNL_SOCKET_BUFFER_SIZE);
+		if (err) {
+			fprintf(stderr, "Failed to allocate the ring: %s\n",
+				strerror(-err));
+			goto err_ring_init;
+		}
+	}
+
+	/* Only netlink messages need the family to be dissected */
+	err = 0;
+	if (pcap->format == PSAMPLE_PCAP_FORMAT_PCAP)
+		err = psample_pcap_genl_init(handle);
+	if (err) {
+		fprintf(stderr, "Failed to dump generic netlink families\n");
+		goto err_genl_init;
+	}
+
+	return 0;
+
+err_genl_init:
+	spsc_ring_fini(&pcap->ring);
+err_ring_init:
+	pcap_writer_close(pcap->writer);
+err_writer_open:
+	if (pcap->fd != STDOUT_FILENO)
+		close(pcap->fd);
+	return -1;
+}
+
+void psample_pcap_fini(struct psample_handle *handle)
+{
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	int err;
+
+	err = pcap_writer_close(pcap->writer);
+	if (err)
+		LOG_ERR("Could not write the pcap file: %s", strerror(-err));
+	if (pcap->fd != STDOUT_FILENO)
+		close(pcap->fd);
+	free(pcap->ifaces);
+	spsc_ring_fini(&pcap->ring);
+}
+
+int psample_pcap_get_stats(struct psample_handle *handle,
+			   struct psample_pcap_stats *stats)
+{
+	struct psample_pcap *pcap;
+
+	if (!handle || !stats) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
+
+	pcap = &handle->psample_pcap;
+	stats->ring_max_used = atomic_load_explicit(&pcap->stats.ring_max_used,
+						    memory_order_relaxed);
+	stats->ring_stalls = atomic_load_explicit(&pcap->stats.ring_stalls,
+						  memory_order_relaxed);
+	stats->ring_stall_usec =
+		atomic_load_explicit(&pcap->stats.ring_stall_usec,
+				     memory_order_relaxed);
+	stats->ring_drops = atomic_load_explicit(&pcap->stats.ring_drops,
+						 memory_order_relaxed);
+	stats->ring_depth = pcap->ring.slots ? pcap->ring.size : 0;
+	stats->ring_used = pcap->ring.slots ? spsc_ring_used(&pcap->ring) : 0;
+	return 0;
+}
+
+static int attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type;
+
+	type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, PSAMPLE_ATTR_MAX) < 0)
+		return MNL_CB_ERROR;
+
+	if (type == PSAMPLE_ATTR_IIFINDEX &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_OIFINDEX &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_SAMPLE_RATE &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_ORIGSIZE &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_SAMPLE_GROUP &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_GROUP_SEQ &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_GROUP_REFCOUNT &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_TUNNEL &&
+	    mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_OUT_TC &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_OUT_TC_OCC &&
+	    mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_LATENCY &&
+	    mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_TIMESTAMP &&
+	    mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+		return MNL_CB_ERROR;
+	if (type == PSAMPLE_ATTR_PROTO &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+/* Like mnl_attr_parse() with attr_cb(), restricted to the attributes in the
+ * PSAMPLE_FIELD_* mask fields. The walk stops once all of them are found. A
+ * PSAMPLE_ATTR_DATA cut short by the snaplen filter is kept, and its captured
+ * length is returned in data_len.
+ */
+static int psample_attrs_parse(const struct nlmsghdr *nlhdr, __u32 fields,
+			       struct nlattr **tb, __u32 *data_len)
+{
+	const struct nlattr *attr;
+	const char *tail;
+	__u32 found = 0;
+	int type;
+	int ret;
+
+	/* The trimmed length is not aligned, unlike the tail libmnl uses */
+	tail = (const char *)nlhdr + nlhdr->nlmsg_len;
+
+	mnl_attr_for_each(attr, nlhdr, sizeof(struct genlmsghdr)) {
+		type = mnl_attr_get_type(attr);
+		if (type > PSAMPLE_ATTR_MAX || !(fields & PSAMPLE_FIELD(type)))
+			continue;
+
+		ret = attr_cb(attr, tb);
+		if (ret <= MNL_CB_STOP)
+			return ret;
+
+		found |= PSAMPLE_FIELD(type);
+		if (found == fields)
+			goto out;
+	}
+
+	if ((fields & PSAMPLE_FIELD_DATA) && !tb[PSAMPLE_ATTR_DATA] &&
+	    tail - (const char *)attr >= MNL_ATTR_HDRLEN &&
+	    mnl_attr_get_type(attr) == PSAMPLE_ATTR_DATA)
+		tb[PSAMPLE_ATTR_DATA] = (struct nlattr *)attr;
+
+out:
+	*data_len = 0;
+	if (tb[PSAMPLE_ATTR_DATA]) {
+		const char *payload = mnl_attr_get_payload(tb[PSAMPLE_ATTR_DATA]);
+
+		*data_len = mnl_attr_get_payload_len(tb[PSAMPLE_ATTR_DATA]);
+		if (payload + *data_len > tail)
+			*data_len = tail - payload;
+	}
+
+	return MNL_CB_OK;
+}
+
+struct psample_event_handler_data {
+	struct psample_handle *handle;
+	psample_msg_cb msg_cb;
+	psample_config_cb config_cb;
+	void *config_cb_data;
+	void *msg_cb_data;
+	int cb_retval;
+};
+
+static void
+psample_event_handler_data_init(struct psample_event_handler_data *data,
+				struct psample_handle *handle,
+				psample_msg_cb msg_cb, void *msg_data,
+				psample_config_cb config_cb, void *config_data)
+{
+	data->handle = handle;
+	data->msg_cb = msg_cb;
+	data->msg_cb_data = msg_data;
+	data->config_cb = config_cb;
+	data->config_cb_data = config_data;
+	data->cb_retval = 0;
+}
+
+static int psample_keep_switch_group(const struct nlmsghdr *nlhdr,
+				     void *data)
+{
+	struct psample_keep_switch *sw = data;
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
+	struct psample_group_seq *groups;
+
+	mnl_attr_parse(nlhdr, sizeof(struct genlmsghdr), attr_cb, tb);
+	if (!tb[PSAMPLE_ATTR_SAMPLE_GROUP] || !tb[PSAMPLE_ATTR_GROUP_SEQ])
+		return MNL_CB_OK;
+
+	groups = realloc(sw->groups, (sw->ngroups + 1) * sizeof(*groups));
+	if (!groups)
+		return MNL_CB_ERROR;
+	sw->groups = groups;
+	groups[sw->ngroups].group =
+		mnl_attr_get_u32(tb[PSAMPLE_ATTR_SAMPLE_GROUP]);
+	groups[sw->ngroups].seq = mnl_attr_get_u32(tb[PSAMPLE_ATTR_GROUP_SEQ]);
+	sw->ngroups++;
+	return MNL_CB_OK;
+}
+
+/* Read the group dump requested at the last change. The kernel fills it in
+ * when it is requested, so it can be read later on. Without wait, returns
+ * -EAGAIN if the dump is not all read yet; until then, the samples of the
+ * groups not read yet get the new fraction.
+ */
+static int psample_keep_switch_collect(struct psample_handle *handle,
+				       bool wait)
+{
+	struct psample_keep_switch *sw =
+		&handle->keep_switches[(handle->keep_switch_next +
+					PSAMPLE_KEEP_SWITCHES - 1) %
+				       PSAMPLE_KEEP_SWITCHES];
+	struct mnlg_socket *nlg = handle->control_nlh;
+	int err;
+
+	if (!handle->keep_switch_pending)
+		return 0;
+
+	if (wait)
+		err = mnlg_socket_recv_run(nlg, psample_keep_switch_group, sw);
+	else
+		err = mnlg_socket_recv_poll(nlg, psample_keep_switch_group, sw);
+	if (err < 0 && !wait && errno == EAGAIN)
+		return -EAGAIN;
+	if (err < 0) {
+		LOG_WARN("Could not read the group sequence numbers: %s",
+			 strerror(errno));
+		sw->ngroups = 0;
+	}
+
+	handle->keep_switch_pending = false;
+	return 0;
+}
+
+/* Record where the fraction changed, once the new filter is attached. The
+ * sequence numbers of the groups are requested now and read without wait; if
+ * they can not be read, the samples still queued get the new fraction.
+ */
+static void psample_keep_switch_record(struct psample_handle *handle,
+				       double old_keep)
+{
+	struct psample_keep_switch *sw =
+		&handle->keep_switches[handle->keep_switch_next];
+	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP;
+	struct mnlg_socket *nlg = handle->control_nlh;
+	struct nlmsghdr *nlhdr;
+
+	sw->old_keep = old_keep;
+	sw->ngroups = 0;
+
+	handle->keep_switch_next = (handle->keep_switch_next + 1) %
+				   PSAMPLE_KEEP_SWITCHES;
+	if (handle->keep_nswitches < PSAMPLE_KEEP_SWITCHES)
+		handle->keep_nswitches++;
+
+	nlhdr = mnlg_msg_prepare(nlg, PSAMPLE_CMD_GET_GROUP, flags, nlg->id,
+				 nlg->version);
+	if (mnlg_socket_send(nlg, nlhdr) < 0) {
+		LOG_WARN("Could not read the group sequence numbers: %s",
+			 strerror(errno));
+		return;
+	}
+
+	handle->keep_switch_pending = true;
+	psample_keep_switch_collect(handle, false);
+}
+
+/* The keep fraction of the filter that accepted a sample, going back from
+ * the last change as long as the sample was queued before it.
+ */
+static double psample_keep_of(const struct psample_handle *handle,
+			      struct nlattr **tb)
+{
+	double keep = handle->filter_opts.keep;
+	const struct psample_keep_switch *sw;
+	unsigned int i, j;
+	__u32 group;
+	__u32 seq;
+
+	if (!tb[PSAMPLE_ATTR_SAMPLE_GROUP] || !tb[PSAMPLE_ATTR_GROUP_SEQ])
+		return keep;
+	group = mnl_attr_get_u32(tb[PSAMPLE_ATTR_SAMPLE_GROUP]);
+	seq = mnl_attr_get_u32(tb[PSAMPLE_ATTR_GROUP_SEQ]);
+
+	for (i = 1; i <= handle->keep_nswitches; i++) {
+		sw = &handle->keep_switches[(handle->keep_switch_next +
+					     PSAMPLE_KEEP_SWITCHES - i) %
+					    PSAMPLE_KEEP_SWITCHES];
+		for (j = 0; j < sw->ngroups; j++)
+			if (sw->groups[j].group == group)
+				break;
+		if (j == sw->ngroups || (__s32)(seq - sw->groups[j].seq) >= 0)
+			break;
+		keep = sw->old_keep;
+	}
+
+	return keep;
+}
+
+/* The fields to parse of samples, with those psample_keep_of() needs */
+static __u32 psample_fields_parsed(const struct psample_handle *handle)
+{
+	if (!handle->keep_nswitches)
+		return handle->fields;
+
+	return handle->fields | PSAMPLE_FIELD_GROUP | PSAMPLE_FIELD_SEQ;
+}
+
+/* The last change must be recorded before, so that its dump is read first */
+static int psample_keep_fraction_set(struct psample_handle *handle,
+				     double keep)
+{
+	double old_keep = handle->filter_opts.keep;
+	int err;
+
+	handle->filter_opts.keep = keep;
+
+	err = psample_filter_apply(handle);
+	if (err)
+		handle->filter_opts.keep = old_keep;
+	else if (keep != old_keep)
+		psample_keep_switch_record(handle, old_keep);
+
+	return err;
+}
+
+#define PSAMPLE_SHED_INTERVAL_MS 100
+
+static long psample_ms_since(const struct timespec *ts, struct timespec *now)
+{
+	return (now->tv_sec - ts->tv_sec) * 1000 +
+	       (now->tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+/* Every PSAMPLE_SHED_INTERVAL_MS, halve the keep fraction if messages were
+ * dropped or the socket backlog is above 3/4 of the receive buffer, and raise
+ * it by a quarter once the backlog is below 1/4 again.
+ */
+static void psample_shed_update(struct psample_handle *handle)
+{
+	struct psample_shed *shed = &handle->shed;
+	double keep = handle->filter_opts.keep;
+	__u32 meminfo[SK_MEMINFO_VARS];
+	struct timespec now;
+	__u64 drops;
+	__u32 backlog;
+	__u32 rcvbuf;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (psample_ms_since(&shed->last_update, &now) <
+	    PSAMPLE_SHED_INTERVAL_MS)
+		return;
+	shed->last_update = now;
+
+	/* The next change waits until the last one is recorded */
+	if (psample_keep_switch_collect(handle, false))
+		return;
+
+	if (psample_meminfo_get(handle, meminfo))
+		return;
+
+	drops = meminfo[SK_MEMINFO_DROPS] + handle->sample_nlh->stats.overruns;
+	backlog = meminfo[SK_MEMINFO_RMEM_ALLOC];
+	rcvbuf = meminfo[SK_MEMINFO_RCVBUF];
+
+	if (drops != shed->last_drops || backlog > rcvbuf / 4 * 3)
+		keep /= 2;
+	else if (backlog < rcvbuf / 4)
+		keep *= 1.25;
+	shed->last_drops = drops;
+
+	if (keep < shed->min_keep)
+		keep = shed->min_keep;
+	if (keep > 1)
+		keep = 1;
+	if (keep == handle->filter_opts.keep)
+		return;
+
+	LOG_DEBUG("Changing keep fraction from %f to %f",
+		  handle->filter_opts.keep, keep);
+	psample_keep_fraction_set(handle, keep);
+}
+
+static int psample_event_handler(const struct nlmsghdr *nlhdr, void *data)
+{
+	struct psample_event_handler_data *event_handler_data = data;
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlhdr);
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
+	__u32 fields = PSAMPLE_FIELD_ALL;
+	__u32 data_len;
+	int ret;
+
+	if (mnl_nlmsg_get_payload_len(nlhdr) < sizeof(*genl))
+		return MNL_CB_OK;
+
+	if (event_handler_data->handle->shed.enabled)
+		psample_shed_update(event_handler_data->handle);
+
+	if (genl->cmd == PSAMPLE_CMD_SAMPLE && event_handler_data->msg_cb)
+		fields = psample_fields_parsed(event_handler_data->handle);
+	psample_attrs_parse(nlhdr, fields, tb, &data_len);
+
+	if ((genl->cmd == PSAMPLE_CMD_SAMPLE) && event_handler_data->msg_cb) {
+		void *cb_data = event_handler_data->msg_cb_data;
+		struct psample_msg msg;
+
+		msg.nlh = nlhdr;
+		msg.tb = tb;
+		msg.data_len = data_len;
+		msg.flow_err = 1;
+		msg.tunnel_parsed = false;
+		msg.keep = psample_keep_of(event_handler_data->handle, tb);
+		ret = event_handler_data->msg_cb(&msg, cb_data);
+	} else if (event_handler_data->config_cb) {
+		void *cb_data = event_handler_data->config_cb_data;
+		struct psample_config config;
+
+		config.tb = tb;
+		config.cmd = genl->cmd;
+		ret = event_handler_data->config_cb(&config, cb_data);
+	} else {
+		return MNL_CB_OK;
+	}
+
+	event_handler_data->cb_retval = ret;
+	if (ret != 0)
+		return MNL_CB_STOP;
+
+	return MNL_CB_OK;
+}
+
+int psample_set_keep_fraction(struct psample_handle *handle, double keep)
+{
+	if (!handle || !(keep > 0 && keep <= 1)) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
+
+	psample_keep_switch_collect(handle, true);
+	return psample_keep_fraction_set(handle, keep);
+}
+
+double psample_get_keep_fraction(struct psample_handle *handle)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return 0;
+	}
+
+	return handle->filter_opts.keep;
+}
+
+int psample_set_keep_auto(struct psample_handle *handle, double min_keep)
+{
+	__u32 meminfo[SK_MEMINFO_VARS];
+
+	if (!handle || min_keep > 1) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
+
+	if (min_keep <= 0) {
+		handle->shed.enabled = false;
+		return 0;
+	}
+
+	handle->shed.enabled = true;
+	handle->shed.min_keep = min_keep;
+	psample_meminfo_get(handle, meminfo);
+	handle->shed.last_drops = meminfo[SK_MEMINFO_DROPS] +
+				  handle->sample_nlh->stats.overruns;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &handle->shed.last_update);
+	return 0;
+}
+
+int psample_set_fields(struct psample_handle *handle, __u32 fields)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return -EINVAL;
+	}
+
+	handle->fields = fields;
+	return 0;
+}
+
+__u32 psample_get_fields(struct psample_handle *handle)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return 0;
+	}
+
+	return handle->fields;
+}
+
+int psample_set_snaplen(struct psample_handle *handle, int snaplen)
+{
+	int old_snaplen;
+	int err;
+
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return -EINVAL;
+	}
+
+	old_snaplen = handle->filter_opts.snaplen;
+	handle->filter_opts.snaplen = snaplen < 0 ? -1 : snaplen;
+
+	err = psample_filter_apply(handle);
+	if (err)
+		handle->filter_opts.snaplen = old_snaplen;
+
+	return err;
+}
+
+static int group_cmp(const void *a, const void *b)
+{
+	__u32 group_a = *(const __u32 *)a;
+	__u32 group_b = *(const __u32 *)b;
+
+	return (group_a > group_b) - (group_a < group_b);
+}
+
+int psample_bind_groups(struct psample_handle *handle, const int *groups,
+			unsigned int n)
+{
+	unsigned int old_ngroups;
+	__u32 *old_groups;
+	__u32 *sorted = NULL;
+	unsigned int i, j;
+	int err;
+
+	if (!handle || (n && !groups)) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
+
+	if (n) {
+		sorted = malloc(n * sizeof(*sorted));
+		if (!sorted) {
+			LOG_ERR("Could not allocate memory");
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (groups[i] < 0) {
+			LOG_ERR("Invalid group %d", groups[i]);
+			free(sorted);
+			return -EINVAL;
+		}
+		sorted[i] = groups[i];
+	}
+
+	qsort(sorted, n, sizeof(*sorted), group_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (!j || sorted[j - 1] != sorted[i])
+			sorted[j++] = sorted[i];
+	}
+
+	old_groups = handle->filter_opts.groups;
+	old_ngroups = handle->filter_opts.ngroups;
+	handle->filter_opts.groups = sorted;
+	handle->filter_opts.ngroups = j;
+
+	err = psample_filter_apply(handle);
+	if (err) {
+		handle->filter_opts.groups = old_groups;
+		handle->filter_opts.ngroups = old_ngroups;
+		free(sorted);
+		return err;
+	}
+
+	free(old_groups);
+	return 0;
+}
+
+int psample_bind_group(struct psample_handle *handle, int group)
+{
+	if (group < 0)
+		return psample_bind_groups(handle, NULL, 0);
+
+	return psample_bind_groups(handle, &group, 1);
+}
+
+int psample_dispatch(struct psample_handle *handle, psample_msg_cb msg_cb,
+		     void *msg_data, psample_config_cb config_cb,
+		     void *config_data, bool block)
+{
+	struct psample_event_handler_data event_handler_data;
+	int err;
+
+	if (!handle) {
+		LOG_ERR("handle not initalized");
+		return -ENOMEM;
+	}
+
+	psample_event_handler_data_init(&event_handler_data, handle, msg_cb,
+					msg_data, config_cb, config_data);
+
+	err = mnlg_socket_batch_run(handle->sample_nlh,
+				    block ? MSG_WAITFORONE : MSG_DONTWAIT,
+				    NULL, psample_event_handler,
+				    &event_handler_data);
+	if (err < 0) {
+		if (errno != EWOULDBLOCK || block) {
+			LOG_ERR("Could not recv: %s", strerror(errno));
+			return -errno;
+		}
+	}
+
+	return event_handler_data.cb_retval;
+}
+
+int psample_dispatch_budget(struct psample_handle *handle,
+			    unsigned int max_msgs, psample_msg_cb msg_cb,
+			    void *msg_data, psample_config_cb config_cb,
+			    void *config_data, int *cb_ret)
+{
+	struct psample_event_handler_data event_handler_data;
+	unsigned int budget = max_msgs;
+	int err;
+
+	if (cb_ret)
+		*cb_ret = 0;
+
+	if (!handle) {
+		LOG_ERR("handle not initalized");
+		return -ENOMEM;
+	}
+
+	if (!max_msgs)
+		return 0;
+
+	psample_event_handler_data_init(&event_handler_data, handle, msg_cb,
+					msg_data, config_cb, config_data);
+
+	err = mnlg_socket_batch_run(handle->sample_nlh, MSG_DONTWAIT, &budget,
+				    psample_event_handler, &event_handler_data);
+	if (err < 0 && errno != EWOULDBLOCK) {
+		LOG_ERR("Could not recv: %s", strerror(errno));
+		return -errno;
+	}
+
+	if (cb_ret)
+		*cb_ret = event_handler_data.cb_retval;
+	return max_msgs - budget;
+}
+
+int psample_dispatch_buf(const void *buf, size_t len, __u32 fields,
+			 psample_msg_cb msg_cb, void *msg_data,
+			 psample_config_cb config_cb, void *config_data)
+{
+	struct psample_event_handler_data event_handler_data;
+	/* No shedding and no keep switches: samples are kept with 1 */
+	struct psample_handle handle = {
+		.filter_opts.keep = 1,
+		.fields = fields,
+	};
+
+	psample_event_handler_data_init(&event_handler_data, &handle, msg_cb,
+					msg_data, config_cb, config_data);
+
+	if (mnl_cb_run(buf, len, 0, 0, psample_event_handler,
+		       &event_handler_data) < 0) {
+		LOG_ERR("Could not parse: %s", strerror(errno));
+		return -errno;
+	}
+
+	return event_handler_data.cb_retval;
+}
+
+struct psample_batch_handler_data {
+	struct psample_handle *handle;
+	struct psample_msg_batch *batch;
+	psample_msg_batch_cb batch_cb;
+	void *batch_cb_data;
+	psample_config_cb config_cb;
+	void *config_cb_data;
+	int cb_retval;
+};
+
+static int psample_msg_batch_flush(struct psample_batch_handler_data *data)
+{
+	int ret;
+
+	if (!data->batch->count)
+		return 0;
+
+	ret = data->batch_cb(data->batch, data->batch_cb_data);
+	data->batch->count = 0;
+	return ret;
+}
+
+static int psample_tunnel_attr_validate(const struct nlattr *attr)
+{
+	switch (mnl_attr_get_type(attr)) {
+	case PSAMPLE_TUNNEL_KEY_ATTR_ID:
+		return mnl_attr_validate(attr, MNL_TYPE_U64);
+	case PSAMPLE_TUNNEL_KEY_ATTR_IPV4_SRC:
+	case PSAMPLE_TUNNEL_KEY_ATTR_IPV4_DST:
+		return mnl_attr_validate(attr, MNL_TYPE_U32);
+	case PSAMPLE_TUNNEL_KEY_ATTR_TOS:
+	case PSAMPLE_TUNNEL_KEY_ATTR_TTL:
+		return mnl_attr_validate(attr, MNL_TYPE_U8);
+	case PSAMPLE_TUNNEL_KEY_ATTR_TP_SRC:
+	case PSAMPLE_TUNNEL_KEY_ATTR_TP_DST:
+		return mnl_attr_validate(attr, MNL_TYPE_U16);
+	case PSAMPLE_TUNNEL_KEY_ATTR_IPV6_SRC:
+	case PSAMPLE_TUNNEL_KEY_ATTR_IPV6_DST:
+		return mnl_attr_validate2(attr, MNL_TYPE_UNSPEC, 16);
+	case PSAMPLE_TUNNEL_KEY_ATTR_DONT_FRAGMENT:
+	case PSAMPLE_TUNNEL_KEY_ATTR_CSUM:
+	case PSAMPLE_TUNNEL_KEY_ATTR_OAM:
+	case PSAMPLE_TUNNEL_KEY_ATTR_IPV4_INFO_BRIDGE:
+		return mnl_attr_validate(attr, MNL_TYPE_FLAG);
+	case PSAMPLE_TUNNEL_KEY_ATTR_GENEVE_OPTS:
+	case PSAMPLE_TUNNEL_KEY_ATTR_VXLAN_OPTS:
+	case PSAMPLE_TUNNEL_KEY_ATTR_ERSPAN_OPTS:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Nothing is copied but the scalars, the rest points into the nest */
+static void psample_tunnel_parse(const struct nlattr *nest,
+				 struct psample_tunnel_key *key)
+{
+	const struct nlattr *attr;
+
+	memset(key, 0, sizeof(*key));
+	mnl_attr_for_each_nested(attr, nest) {
+		int type = mnl_attr_get_type(attr);
+		const void *payload = mnl_attr_get_payload(attr);
+		__u16 len = mnl_attr_get_payload_len(attr);
+
+		if (psample_tunnel_attr_validate(attr) < 0)
+			continue;
+		key->present |= PSAMPLE_TUNNEL_FIELD(type);
+
+		switch (type) {
+		case PSAMPLE_TUNNEL_KEY_ATTR_ID:
+			key->id = be64toh(mnl_attr_get_u64(attr));
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_IPV4_SRC:
+			key->ipv4_src = payload;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_IPV4_DST:
+			key->ipv4_dst = payload;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_TOS:
+			key->tos = mnl_attr_get_u8(attr);
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_TTL:
+			key->ttl = mnl_attr_get_u8(attr);
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_TP_SRC:
+			key->tp_src = ntohs(mnl_attr_get_u16(attr));
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_TP_DST:
+			key->tp_dst = ntohs(mnl_attr_get_u16(attr));
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_IPV6_SRC:
+			key->ipv6_src = payload;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_IPV6_DST:
+			key->ipv6_dst = payload;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_GENEVE_OPTS:
+			key->geneve_opts = payload;
+			key->geneve_opts_len = len;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_VXLAN_OPTS:
+			key->vxlan_opts = payload;
+			key->vxlan_opts_len = len;
+			break;
+		case PSAMPLE_TUNNEL_KEY_ATTR_ERSPAN_OPTS:
+			key->erspan_opts = payload;
+			key->erspan_opts_len = len;
+			break;
+		}
+	}
+}
+
+static void psample_msg_fields_fill(struct nlattr **tb, __u32 data_len,
+				    double keep,
+				    struct psample_msg_fields *fields)
+{
+	__u32 present = 0;
+	int type;
+
+	for (type = 0; type <= PSAMPLE_ATTR_MAX; type++)
+		if (tb[type])
+			present |= PSAMPLE_FIELD(type);
+	fields->present = present;
+
+#define PSAMPLE_FIELD_GET(attr, bits) \
+	(tb[attr] ? mnl_attr_get_u##bits(tb[attr]) : 0)
+	fields->group = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_SAMPLE_GROUP, 32);
+	fields->seq = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_GROUP_SEQ, 32);
+	fields->rate = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_SAMPLE_RATE, 32);
+	fields->origsize = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_ORIGSIZE, 32);
+	fields->iif = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_IIFINDEX, 16);
+	fields->oif = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_OIFINDEX, 16);
+	fields->out_tc = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_OUT_TC, 16);
+	fields->proto = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_PROTO, 16);
+	fields->out_tc_occ = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_OUT_TC_OCC, 64);
+	fields->latency = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_LATENCY, 64);
+	fields->timestamp = PSAMPLE_FIELD_GET(PSAMPLE_ATTR_TIMESTAMP, 64);
+#undef PSAMPLE_FIELD_GET
+
+	fields->data_len = data_len;
+	fields->data = tb[PSAMPLE_ATTR_DATA] ?
+		       mnl_attr_get_payload(tb[PSAMPLE_ATTR_DATA]) : NULL;
+	fields->keep = keep;
+
+	fields->tunnel_id = 0;
+}
+
+/* The tunnel ID alone, without decoding the rest of the nest */
+static __u64 psample_tunnel_id(const struct nlattr *nest)
+{
+	const struct nlattr *attr;
+
+	mnl_attr_for_each_nested(attr, nest)
+		if (mnl_attr_get_type(attr) == PSAMPLE_TUNNEL_KEY_ATTR_ID &&
+		    !psample_tunnel_attr_validate(attr))
+			return be64toh(mnl_attr_get_u64(attr));
+
+	return 0;
+}
+
+static void psample_msg_batch_add(struct psample_msg_batch *batch,
+				  const struct psample_msg_fields *fields)
+{
+	unsigned int i = batch->count++;
+
+	batch->present[i] = fields->present;
+	batch->group[i] = fields->group;
+	batch->seq[i] = fields->seq;
+	batch->rate[i] = fields->rate;
+	batch->origsize[i] = fields->origsize;
+	batch->iif[i] = fields->iif;
+	batch->oif[i] = fields->oif;
+	batch->out_tc[i] = fields->out_tc;
+	batch->proto[i] = fields->proto;
+	batch->out_tc_occ[i] = fields->out_tc_occ;
+	batch->latency[i] = fields->latency;
+	batch->timestamp[i] = fields->timestamp;
+	batch->data_len[i] = fields->data_len;
+	batch->data[i] = fields->data;
+	batch->tunnel_id[i] = fields->tunnel_id;
+	batch->keep[i] = fields->keep;
+}
+
+static int psample_batch_event_handler(const struct nlmsghdr *nlhdr,
+				       void *data)
+{
+	struct psample_batch_handler_data *handler_data = data;
+	struct psample_handle *handle = handler_data->handle;
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlhdr);
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
+	struct psample_msg_fields fields;
+	__u32 data_len;
+	int ret = 0;
+
+	if (mnl_nlmsg_get_payload_len(nlhdr) < sizeof(*genl))
+		return MNL_CB_OK;
 
-		psample_pcap_write(handle, handle->sample_nlh->buf,
-				   MNL_SOCKET_BUFFER_SIZE);
+	if (handle->shed.enabled)
+		psample_shed_update(handle);
+
+	if (genl->cmd == PSAMPLE_CMD_SAMPLE) {
+		if (!handler_data->batch_cb)
+			return MNL_CB_OK;
+
+		psample_attrs_parse(nlhdr, psample_fields_parsed(handle), tb,
+				    &data_len);
+		psample_msg_fields_fill(tb, data_len,
+					psample_keep_of(handle, tb), &fields);
+		if (tb[PSAMPLE_ATTR_TUNNEL])
+			fields.tunnel_id =
+				psample_tunnel_id(tb[PSAMPLE_ATTR_TUNNEL]);
+		psample_msg_batch_add(handler_data->batch, &fields);
+		if (handler_data->batch->count == PSAMPLE_MSG_BATCH_MAX)
+			ret = psample_msg_batch_flush(handler_data);
+	} else {
+		struct psample_config config;
+		int config_ret = 0;
+
+		ret = psample_msg_batch_flush(handler_data);
+		if (handler_data->config_cb) {
+			psample_attrs_parse(nlhdr, PSAMPLE_FIELD_ALL, tb,
+					    &data_len);
+			config.tb = tb;
+			config.cmd = genl->cmd;
+			config_ret = handler_data->config_cb(&config,
+						handler_data->config_cb_data);
+		}
+		if (!ret)
+			ret = config_ret;
+	}
 
-	} while (err > 0);
+	handler_data->cb_retval = ret;
+	if (ret != 0)
+		return MNL_CB_STOP;
 
-	return err;
+	return MNL_CB_OK;
 }
 
-int psample_pcap_init(const char *out_file, struct psample_handle *handle)
+int psample_dispatch_batch(struct psample_handle *handle,
+			   psample_msg_batch_cb batch_cb, void *batch_data,
+			   psample_config_cb config_cb, void *config_data,
+			   bool block)
 {
+	struct psample_batch_handler_data handler_data = {};
+	struct psample_msg_batch batch;
+	int flags = block ? MSG_WAITFORONE : MSG_DONTWAIT;
+	struct mnlg_socket *nlg;
+	unsigned int budget;
+	int recv_errno;
 	int err;
 
-	handle->psample_pcap.snaplen = 0xffff;
-
-	handle->psample_pcap.pcap_handle =
-		pcap_open_dead(DLT_NETLINK, handle->psample_pcap.snaplen);
-	if (!handle->psample_pcap.pcap_handle) {
-		perror("pcap_open_dead");
-		return -1;
-	}
-
-	handle->psample_pcap.pcap_dumper =
-		pcap_dump_open(handle->psample_pcap.pcap_handle, out_file);
-	if (!handle->psample_pcap.pcap_dumper) {
-		pcap_perror(handle->psample_pcap.pcap_handle, "pcap_dump_open");
-		goto err_dump_open;
+	if (!handle) {
+		LOG_ERR("handle not initalized");
+		return -ENOMEM;
 	}
 
-	err = psample_pcap_buf_init(handle);
-	if (err)
-		goto err_buf_init;
+	batch.count = 0;
+	handler_data.handle = handle;
+	handler_data.batch = &batch;
+	handler_data.batch_cb = batch_cb;
+	handler_data.batch_cb_data = batch_data;
+	handler_data.config_cb = config_cb;
+	handler_data.config_cb_data = config_data;
+
+	/* The decoded samples point into the receive buffers, so they are
+	 * flushed before the next receive reuses them. Receive here, or take
+	 * what is left of the batch of a previous call, and run exactly the
+	 * datagrams of that receive, so that the run never receives again.
+	 */
+	nlg = handle->sample_nlh;
+	do {
+		err = mnlg_socket_batch_fill(nlg, UINT_MAX, flags);
+		recv_errno = errno;
+		if (err <= 0)
+			break;
+		budget = err;
+		err = mnlg_socket_batch_run(nlg, flags, &budget,
+					    psample_batch_event_handler,
+					    &handler_data);
+		recv_errno = errno;
+		if (!handler_data.cb_retval)
+			handler_data.cb_retval =
+				psample_msg_batch_flush(&handler_data);
+	} while (err > 0 && !handler_data.cb_retval);
 
-	err = psample_pcap_genl_init(handle);
-	if (err) {
-		fprintf(stderr, "Failed to dump generic netlink families\n");
-		goto err_genl_init;
+	if (err < 0) {
+		if (recv_errno != EWOULDBLOCK || block) {
+			LOG_ERR("Could not recv: %s", strerror(recv_errno));
+			return -recv_errno;
+		}
 	}
 
-	return 0;
+	return handler_data.cb_retval;
+}
 
-err_genl_init:
-	psample_pcap_buf_fini(handle);
-err_buf_init:
-	pcap_dump_close(handle->psample_pcap.pcap_dumper);
-err_dump_open:
-	pcap_close(handle->psample_pcap.pcap_handle);
-	return -1;
+/* Datagrams of the sample socket taken over by psample_recv_batch() */
+struct psample_batch {
+	struct psample_handle *handle;
+	unsigned int next;
+	unsigned int count;
+	const struct nlmsghdr *nlh;
+	int len;
+	struct psample_msg msg;
+	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1];
+};
+
+struct psample_batch *psample_batch_alloc(void)
+{
+	return calloc(1, sizeof(struct psample_batch));
 }
 
-void psample_pcap_fini(struct psample_handle *handle)
+void psample_batch_free(struct psample_batch *batch)
 {
-	psample_pcap_buf_fini(handle);
-	pcap_dump_close(handle->psample_pcap.pcap_dumper);
-	pcap_close(handle->psample_pcap.pcap_handle);
+	free(batch);
 }
 
-static int attr_cb(const struct nlattr *attr, void *data)
+int psample_recv_batch(struct psample_handle *handle,
+		       struct psample_batch *batch, bool block)
 {
-	const struct nlattr **tb = data;
-	int type;
+	struct mnlg_socket *nlg;
+	int n;
 
-	type = mnl_attr_get_type(attr);
+	if (!handle || !batch) {
+		LOG_ERR("Called with invalid arguments");
+		return -EINVAL;
+	}
 
-	if (mnl_attr_type_valid(attr, PSAMPLE_ATTR_MAX) < 0)
-		return MNL_CB_ERROR;
+	nlg = handle->sample_nlh;
+	n = mnlg_socket_batch_fill(nlg, UINT_MAX,
+				   block ? MSG_WAITFORONE : MSG_DONTWAIT);
+	if (n < 0) {
+		if (errno == EWOULDBLOCK && !block)
+			return 0;
+		LOG_ERR("Could not recv: %s", strerror(errno));
+		return -errno;
+	}
 
-	if (type == PSAMPLE_ATTR_IIFINDEX &&
-	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_OIFINDEX &&
-	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_SAMPLE_RATE &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_ORIGSIZE &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_SAMPLE_GROUP &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_GROUP_SEQ &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == PSAMPLE_ATTR_GROUP_REFCOUNT &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
+	if (handle->shed.enabled)
+		psample_shed_update(handle);
 
-	tb[type] = attr;
-	return MNL_CB_OK;
-}
+	batch->handle = handle;
+	batch->next = nlg->batch.next;
+	batch->count = nlg->batch.count;
+	batch->nlh = NULL;
+	batch->len = 0;
+	nlg->batch.next = nlg->batch.count;
 
-struct psample_event_handler_data {
-	psample_msg_cb msg_cb;
-	psample_config_cb config_cb;
-	void *config_cb_data;
-	void *msg_cb_data;
-	int cb_retval;
-};
+	return n;
+}
 
-static int psample_event_handler(const struct nlmsghdr *nlhdr, void *data)
+const struct psample_msg *psample_batch_next(struct psample_batch *batch)
 {
-	struct psample_event_handler_data *event_handler_data = data;
-	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlhdr);
-	struct nlattr *tb[PSAMPLE_ATTR_MAX + 1] = {};
-	int ret;
+	const struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+	unsigned int len = 0;
+
+	for (;;) {
+		if (!batch->nlh || !mnl_nlmsg_ok(batch->nlh, batch->len)) {
+			if (batch->next == batch->count)
+				return NULL;
+			/* Truncated and foreign datagrams are skipped */
+			batch->nlh = mnlg_batch_datagram(
+				batch->handle->sample_nlh, batch->next++, &len);
+			batch->len = len;
+			continue;
+		}
 
-	mnl_attr_parse(nlhdr, sizeof(struct genlmsghdr), attr_cb, tb);
+		nlh = batch->nlh;
+		batch->nlh = mnl_nlmsg_next(nlh, &batch->len);
+		if (nlh->nlmsg_type < NLMSG_MIN_TYPE ||
+		    mnl_nlmsg_get_payload_len(nlh) < sizeof(*genl))
+			continue;
+		/* Config notifications are dropped, see psample.h */
+		genl = mnl_nlmsg_get_payload(nlh);
+		if (genl->cmd != PSAMPLE_CMD_SAMPLE)
+			continue;
+
+		memset(batch->tb, 0, sizeof(batch->tb));
+		if (psample_attrs_parse(nlh,
+					psample_fields_parsed(batch->handle),
+					batch->tb,
+					&batch->msg.data_len) != MNL_CB_OK)
+			continue;
+		batch->msg.nlh = nlh;
+		batch->msg.tb = batch->tb;
+		batch->msg.flow_err = 1;
+		batch->msg.tunnel_parsed = false;
+		batch->msg.keep = psample_keep_of(batch->handle, batch->tb);
+		return &batch->msg;
+	}
+}
 
-	if ((genl->cmd == PSAMPLE_CMD_SAMPLE) && event_handler_data->msg_cb) {
-		void *cb_data = event_handler_data->msg_cb_data;
-		struct psample_msg msg;
+int psample_get_fd(struct psample_handle *handle)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return -EINVAL;
+	}
 
-		msg.tb = tb;
-		ret = event_handler_data->msg_cb(&msg, cb_data);
-	} else if (event_handler_data->config_cb) {
-		void *cb_data = event_handler_data->config_cb_data;
-		struct psample_config config;
+	return mnlg_socket_get_poll_fd(handle->sample_nlh);
+}
 
-		config.tb = tb;
-		config.cmd = genl->cmd;
-		ret = event_handler_data->config_cb(&config, cb_data);
-	} else {
-		return MNL_CB_OK;
+enum psample_recv_backend
+psample_get_recv_backend(struct psample_handle *handle)
+{
+	if (!handle) {
+		LOG_ERR("Called with invalid handle");
+		return PSAMPLE_RECV_RECVMMSG;
 	}
 
-	event_handler_data->cb_retval = ret;
-	if (ret != 0)
-		return MNL_CB_STOP;
-
-	return MNL_CB_OK;
+	return handle->sample_nlh->uring ? PSAMPLE_RECV_IO_URING :
+					   PSAMPLE_RECV_RECVMMSG;
 }
 
-static struct sock_filter psample_group_filter[] = {
-	BPF_STMT(BPF_LD + BPF_IMM, sizeof(struct nlmsghdr) +
-				   sizeof(struct genlmsghdr)),
-	BPF_STMT(BPF_LDX + BPF_IMM, PSAMPLE_ATTR_SAMPLE_GROUP),
-	BPF_STMT(BPF_LD + BPF_ABS, SKF_AD_OFF + SKF_AD_NLATTR),
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 4, 0),		 /* pass */
-	BPF_STMT(BPF_MISC + BPF_TAX, 0),
-	BPF_STMT(BPF_LD + BPF_W + BPF_IND, 4),
+/* Wait for the next datagram as long as the flush interval of what is held
+ * allows, and flush if it went by first. Returns -1 with errno set if the
+ * wait or the flush failed.
+ */
+static int psample_pcap_idle_flush(struct mnlg_socket *nlg,
+				   struct pcap_writer *writer)
+{
+	struct pollfd pfd = {
+		.fd = mnlg_socket_get_poll_fd(nlg),
+		.events = POLLIN,
+	};
+	int timeout;
+	int err;
 
-	/* This command should be edited with the right group value */
-#define FILTER_GROUP_COMMAND 6
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0x38000000, 1, 0),	 /* pass */
+	timeout = pcap_writer_flush_timeout(writer);
+	if (timeout < 0)
+		return 0;
 
-	/* drop */
-	BPF_STMT(BPF_RET + BPF_K, (u_int) 0),
+	err = poll(&pfd, 1, timeout);
+	if (err < 0)
+		return errno == EINTR ? 0 : -1;
+	if (err)
+		return 0;
 
-	/* pass */
-	BPF_STMT(BPF_RET + BPF_K, (u_int) -1),
-};
+	err = pcap_writer_flush(writer);
+	if (err) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
 
-int psample_bind_group(struct psample_handle *handle, int group)
+/* Each receive batch is written with a single writev() straight from the
+ * receive buffers, or staged for a later one by the flush policy.
+ */
+static int psample_socket_recv_write(struct mnlg_socket *nlg,
+				     struct psample_handle *handle)
 {
-	struct sock_fprog *fprog;
+	struct nlmsghdr *nlh;
+	unsigned int len;
+	__u64 ts;
 	int err;
-	int fd;
 
-	if (!handle) {
-		LOG_ERR("Called with invalid handle");
-		return -EINVAL;
-	}
+	do {
+		err = psample_pcap_idle_flush(nlg,
+					      handle->psample_pcap.writer);
+		if (err)
+			break;
 
-	fd = mnlg_socket_get_fd(handle->sample_nlh);
+		err = mnlg_socket_batch_fill(nlg, UINT_MAX, MSG_WAITFORONE);
+		if (err <= 0)
+			break;
 
-	fprog = &handle->sample_filter_fprog;
-	if (fprog->filter) {
-		err = setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER,
-				 fprog, sizeof(*fprog));
-		if (err) {
-			LOG_ERR("Could not detach filter prog: %s",
-				strerror(errno));
-			return -errno;
+		ts = psample_pcap_recv_ts();
+		for (; nlg->batch.next < nlg->batch.count; nlg->batch.next++) {
+			nlh = mnlg_batch_datagram(nlg, nlg->batch.next, &len);
+			if (nlh)
+				psample_pcap_write_msgs(handle, nlh, len, ts);
 		}
 
-		free(fprog->filter);
-	}
-
-	fprog->filter = malloc(sizeof(psample_group_filter));
-	memcpy(fprog->filter, psample_group_filter,
-	       sizeof(psample_group_filter));
-	fprog->filter[FILTER_GROUP_COMMAND].k = ntohl(group);
-	fprog->len = ARRAY_SIZE(psample_group_filter);
+		err = pcap_writer_batch_end(handle->psample_pcap.writer);
+		if (err) {
+			errno = -err;
+			err = -1;
+		}
+	} while (!err);
 
-	err = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, fprog,
-			 sizeof(*fprog));
-	if (err) {
-		LOG_ERR("Could not attach filter prog: %s", strerror(errno));
-		return -errno;
-	}
+	return err;
+}
 
-	return 0;
+/* The free slots of the ring, or 0 if the datagrams are to be dropped */
+static unsigned int psample_pcap_ring_reserve(struct psample_pcap *pcap)
+{
+	struct timespec start, end;
+	unsigned int avail;
+
+	avail = spsc_ring_free(&pcap->ring);
+	if (avail)
+		return avail;
+
+	atomic_fetch_add_explicit(&pcap->stats.ring_stalls, 1,
+				  memory_order_relaxed);
+	if (pcap->ring_overflow == PSAMPLE_PCAP_RING_DROP)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	avail = spsc_ring_wait_free(&pcap->ring);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	atomic_fetch_add_explicit(&pcap->stats.ring_stall_usec,
+				  (end.tv_sec - start.tv_sec) * 1000000 +
+				  (end.tv_nsec - start.tv_nsec) / 1000,
+				  memory_order_relaxed);
+	return avail;
 }
 
-static int psample_set_blocking(struct psample_handle *handle, bool block)
+/* Receive straight into the free slots of the ring and publish them to the
+ * writer thread, until an error or until the writer thread fails.
+ */
+static int psample_pcap_ring_recv(struct psample_handle *handle)
 {
-	int fd;
-	int flags;
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	struct mnlg_socket *nlg = handle->sample_nlh;
+	struct spsc_ring *ring = &pcap->ring;
+	struct psample_pcap_slot *slot;
+	struct nlmsghdr *nlh;
+	unsigned int avail;
+	unsigned int used;
+	unsigned int len;
+	unsigned int n;
+	unsigned int i;
+	__u64 ts;
+	int err;
 
-	fd = mnlg_socket_get_fd(handle->sample_nlh);
-	flags = fcntl(fd, F_GETFL);
-	if (!block)
-		flags |= O_NONBLOCK;
-	else
-		flags &= ~O_NONBLOCK;
+	for (;;) {
+		avail = psample_pcap_ring_reserve(pcap);
+		if (spsc_ring_closed(ring)) {
+			errno = -pcap->ring_err;
+			return -1;
+		}
 
-	if (fcntl(fd, F_SETFL, flags) < 0) {
-		LOG_ERR("Could not set O_NONBLOCK: %s", strerror(errno));
-		return -1;
-	}
+		if (avail > nlg->batch.size)
+			avail = nlg->batch.size;
+		for (i = 0; i < (avail ? avail : nlg->batch.size); i++) {
+			slot = avail ? spsc_ring_prod_slot(ring, i) : NULL;
+			mnlg_batch_buf_set(nlg, i, slot ? slot->buf : NULL);
+		}
 
-	return 0;
+		err = mnlg_socket_batch_fill(nlg, avail ? avail : UINT_MAX,
+					     MSG_WAITFORONE);
+		if (err <= 0)
+			return err;
+
+		ts = psample_pcap_recv_ts();
+		for (n = 0; nlg->batch.next < nlg->batch.count;
+		     nlg->batch.next++) {
+			if (!avail) {
+				atomic_fetch_add_explicit(&pcap->stats.ring_drops,
+							  1,
+							  memory_order_relaxed);
+				continue;
+			}
+
+			slot = spsc_ring_prod_slot(ring, n++);
+			nlh = mnlg_batch_datagram(nlg, nlg->batch.next, &len);
+			slot->ts = ts;
+			slot->len = nlh ? len : 0;
+			/* The io_uring backend receives into its own buffers */
+			if (nlh && (char *)nlh != slot->buf)
+				memcpy(slot->buf, nlh, len);
+		}
+		if (!n)
+			continue;
+
+		spsc_ring_publish(ring, n);
+		/* The receiver is the only writer of the maximum */
+		used = spsc_ring_used(ring);
+		if (used > atomic_load_explicit(&pcap->stats.ring_max_used,
+						memory_order_relaxed))
+			atomic_store_explicit(&pcap->stats.ring_max_used, used,
+					      memory_order_relaxed);
+	}
 }
 
-int psample_dispatch(struct psample_handle *handle, psample_msg_cb msg_cb,
-		     void *msg_data, psample_config_cb config_cb,
-		     void *config_data, bool block)
+/* Write what the receiver publishes, one writer batch per wakeup, until the
+ * ring is closed and drained. A write error closes the ring.
+ */
+static void *psample_pcap_writer_thread(void *data)
 {
-	struct psample_event_handler_data event_handler_data;
+	struct psample_handle *handle = data;
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	struct psample_pcap_slot *slot;
+	unsigned int n;
+	unsigned int i;
 	int err;
 
-	if (!handle) {
-		LOG_ERR("handle not initalized");
-		return -ENOMEM;
-	}
+	for (;;) {
+		n = spsc_ring_wait_used(&pcap->ring,
+					pcap_writer_flush_timeout(pcap->writer));
+		if (!n) {
+			if (spsc_ring_closed(&pcap->ring))
+				break;
+			/* The flush interval went by without samples */
+			err = pcap_writer_flush(pcap->writer);
+			if (err) {
+				pcap->ring_err = err;
+				spsc_ring_close(&pcap->ring);
+				break;
+			}
+			continue;
+		}
 
-	event_handler_data.msg_cb = msg_cb;
-	event_handler_data.msg_cb_data = msg_data;
-	event_handler_data.config_cb = config_cb;
-	event_handler_data.config_cb_data = config_data;
+		for (i = 0; i < n; i++) {
+			slot = spsc_ring_cons_slot(&pcap->ring, i);
+			if (slot->len)
+				psample_pcap_write_msgs(handle, slot->buf,
+							slot->len, slot->ts);
+		}
 
-	psample_set_blocking(handle, block);
-	err = mnlg_socket_recv_run(handle->sample_nlh, psample_event_handler,
-				   &event_handler_data);
-	if (err < 0) {
-		if (errno != EWOULDBLOCK || block) {
-			LOG_ERR("Could not recv: %s", strerror(errno));
-			return -errno;
+		err = pcap_writer_batch_end(pcap->writer);
+		spsc_ring_release(&pcap->ring, n);
+		if (err) {
+			pcap->ring_err = err;
+			spsc_ring_close(&pcap->ring);
+			break;
 		}
 	}
 
-	return event_handler_data.cb_retval;
+	return NULL;
 }
 
-static int psample_socket_recv_write(struct mnlg_socket *nlg, void* data_write)
+static int psample_pcap_ring_dispatch(struct psample_handle *handle)
 {
+	struct psample_pcap *pcap = &handle->psample_pcap;
+	struct mnlg_socket *nlg = handle->sample_nlh;
+	pthread_t thread;
+	unsigned int i;
+	int saved_errno;
 	int err;
 
-	do {
-		err = mnl_socket_recvfrom(nlg->nl, nlg->buf,
-					  MNL_SOCKET_BUFFER_SIZE);
-		if (err <= 0)
-			break;
+	err = pthread_create(&thread, NULL, psample_pcap_writer_thread,
+			     handle);
+	if (err) {
+		errno = err;
+		return -1;
+	}
 
-		psample_pcap_write(data_write, nlg->buf,
-				   MNL_SOCKET_BUFFER_SIZE);
+	err = psample_pcap_ring_recv(handle);
+	saved_errno = errno;
 
-	} while (err > 0);
+	spsc_ring_close(&pcap->ring);
+	pthread_join(thread, NULL);
+	for (i = 0; i < nlg->batch.size; i++)
+		mnlg_batch_buf_set(nlg, i, NULL);
 
+	errno = pcap->ring_err ? -pcap->ring_err : saved_errno;
 	return err;
 }
 
@@ -561,8 +2232,10 @@ int psample_write_pcap_dispatch(struct psample_handle *handle)
 		return -ENOMEM;
 	}
 
-	psample_set_blocking(handle, true);
-	err = psample_socket_recv_write(handle->sample_nlh, handle);
+	if (handle->psample_pcap.ring.slots)
+		err = psample_pcap_ring_dispatch(handle);
+	else
+		err = psample_socket_recv_write(handle->sample_nlh, handle);
 	if (err < 0) {
 		LOG_ERR("Could not recv: %s", strerror(errno));
 		return -errno;
@@ -611,6 +2284,7 @@ int psample_group_foreach(struct psample_handle *handle,
 	struct nlmsghdr *nlhdr;
 	int err;
 
+	psample_keep_switch_collect(handle, true);
 	nlhdr = mnlg_msg_prepare(handle->control_nlh, PSAMPLE_CMD_GET_GROUP,
 				 flags, handle->control_nlh->id,
 				 handle->control_nlh->version);
@@ -694,6 +2368,11 @@ bool psample_msg_proto_exist(const struct psample_msg *msg)
 	return msg->tb[PSAMPLE_ATTR_PROTO];
 }
 
+bool psample_msg_tunnel_exist(const struct psample_msg *msg)
+{
+	return msg->tb[PSAMPLE_ATTR_TUNNEL];
+}
+
 __u32 psample_msg_group(const struct psample_msg *msg)
 {
 	return mnl_attr_get_u32(msg->tb[PSAMPLE_ATTR_SAMPLE_GROUP]);
@@ -719,6 +2398,13 @@ __u32 psample_msg_origsize(const struct psample_msg *msg)
 	return mnl_attr_get_u32(msg->tb[PSAMPLE_ATTR_ORIGSIZE]);
 }
 
+__u32 psample_msg_rate_effective(const struct psample_msg *msg)
+{
+	double rate = psample_msg_rate(msg) / msg->keep + 0.5;
+
+	return rate < UINT32_MAX ? rate : UINT32_MAX;
+}
+
 __u32 psample_msg_seq(const struct psample_msg *msg)
 {
 	return mnl_attr_get_u32(msg->tb[PSAMPLE_ATTR_GROUP_SEQ]);
@@ -726,7 +2412,7 @@ __u32 psample_msg_seq(const struct psample_msg *msg)
 
 __u32 psample_msg_data_len(const struct psample_msg *msg)
 {
-	return mnl_attr_get_payload_len(msg->tb[PSAMPLE_ATTR_DATA]);
+	return msg->data_len;
 }
 
 __u8 *psample_msg_data(const struct psample_msg *msg)
@@ -759,6 +2445,122 @@ __u16 psample_msg_proto(const struct psample_msg *msg)
 	return mnl_attr_get_u16(msg->tb[PSAMPLE_ATTR_PROTO]);
 }
 
+void psample_msg_get(const struct psample_msg *msg,
+		     struct psample_msg_fields *fields)
+{
+	struct psample_tunnel_key key;
+
+	psample_msg_fields_fill(msg->tb, msg->data_len, msg->keep, fields);
+	if (!psample_msg_tunnel_get(msg, &key))
+		fields->tunnel_id = key.id;
+}
+
+const struct psample_flow_key *psample_msg_flow(const struct psample_msg *msg)
+{
+	/* The cache is not part of the message seen by the caller */
+	struct psample_msg *m = (struct psample_msg *)msg;
+
+	if (!msg->tb[PSAMPLE_ATTR_DATA])
+		return NULL;
+
+	if (m->flow_err > 0)
+		m->flow_err = psample_dissect(psample_msg_data(msg),
+					      msg->data_len, &m->flow);
+
+	return m->flow_err ? NULL : &m->flow;
+}
+
+int psample_msg_flow_encap(const struct psample_msg *msg, unsigned int depth,
+			   struct psample_flow *flow)
+{
+	if (!msg->tb[PSAMPLE_ATTR_DATA])
+		return -ENOENT;
+
+	return psample_dissect_encap(psample_msg_data(msg), msg->data_len,
+				     depth, flow);
+}
+
+int psample_msg_tunnel_get(const struct psample_msg *msg,
+			   struct psample_tunnel_key *key)
+{
+	/* The cache is not part of the message seen by the caller */
+	struct psample_msg *m = (struct psample_msg *)msg;
+
+	if (!msg->tb[PSAMPLE_ATTR_TUNNEL])
+		return -ENOENT;
+
+	if (!m->tunnel_parsed) {
+		psample_tunnel_parse(msg->tb[PSAMPLE_ATTR_TUNNEL], &m->tunnel);
+		m->tunnel_parsed = true;
+	}
+
+	*key = m->tunnel;
+	return 0;
+}
+
+/* A clone is laid out as the struct, its attribute table and a copy of the
+ * message the table points into.
+ */
+#define PSAMPLE_MSG_CLONE_TB_OFF sizeof(struct psample_msg)
+#define PSAMPLE_MSG_CLONE_NLH_OFF (PSAMPLE_MSG_CLONE_TB_OFF + \
+				   (PSAMPLE_ATTR_MAX + 1) * \
+				   sizeof(struct nlattr *))
+
+size_t psample_msg_clone_size(const struct psample_msg *msg)
+{
+	return PSAMPLE_MSG_CLONE_NLH_OFF + msg->nlh->nlmsg_len;
+}
+
+struct psample_msg *psample_msg_clone(const struct psample_msg *msg,
+				      void *buf, size_t size)
+{
+	struct psample_msg *clone = buf;
+	struct nlmsghdr *nlh;
+	int type;
+
+	if (size < psample_msg_clone_size(msg)) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	nlh = (struct nlmsghdr *)((char *)buf + PSAMPLE_MSG_CLONE_NLH_OFF);
+	memcpy(nlh, msg->nlh, msg->nlh->nlmsg_len);
+
+	clone->nlh = nlh;
+	clone->tb = (struct nlattr **)((char *)buf + PSAMPLE_MSG_CLONE_TB_OFF);
+	for (type = 0; type <= PSAMPLE_ATTR_MAX; type++) {
+		const char *attr = (const char *)msg->tb[type];
+
+		clone->tb[type] = attr ? (struct nlattr *)
+			((char *)nlh + (attr - (const char *)msg->nlh)) : NULL;
+	}
+	clone->data_len = msg->data_len;
+	clone->keep = msg->keep;
+	clone->flow_err = msg->flow_err;
+	clone->flow = msg->flow;
+	/* The parsed key points into the original message */
+	clone->tunnel_parsed = false;
+
+	return clone;
+}
+
+struct psample_msg *psample_msg_dup(const struct psample_msg *msg)
+{
+	size_t size = psample_msg_clone_size(msg);
+	void *buf;
+
+	buf = malloc(size);
+	if (!buf)
+		return NULL;
+
+	return psample_msg_clone(msg, buf, size);
+}
+
+void psample_msg_free(struct psample_msg *msg)
+{
+	free(msg);
+}
+
 bool psample_config_group_exist(const struct psample_config *config)
 {
 	return config->tb[PSAMPLE_ATTR_SAMPLE_GROUP];
@@ -0,0 +1,174 @@
+/*
+ *   spsc_ring.c	Single producer, single consumer ring of fixed size slots
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "spsc_ring.h"
+
+/* Returns false if timeout_ms, unless negative, went by */
+static bool spsc_ring_futex_wait(_Atomic __u32 *word, __u32 val,
+				 int timeout_ms)
+{
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (long)(timeout_ms % 1000) * 1000000,
+	};
+
+	return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val,
+		       timeout_ms < 0 ? NULL : &ts, NULL, 0) == 0 ||
+	       errno != ETIMEDOUT;
+}
+
+static void spsc_ring_futex_wake(_Atomic __u32 *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Signal an event to a side, waking it if it sleeps. The event counter is
+ * changed before the waiting flag is read, so a side going to sleep either
+ * sees the new counter, or is seen waiting and woken.
+ */
+static void spsc_ring_signal(_Atomic __u32 *events, atomic_bool *waiting)
+{
+	atomic_fetch_add(events, 1);
+	if (atomic_load(waiting))
+		spsc_ring_futex_wake(events);
+}
+
+/* Sleep until ready() is nonzero, the ring is closed, an event comes or
+ * timeout_ms, unless negative, went by. Returns the last value of ready().
+ */
+static unsigned int spsc_ring_wait(struct spsc_ring *ring,
+				   _Atomic __u32 *events, atomic_bool *waiting,
+				   unsigned int (*ready)(struct spsc_ring *),
+				   int timeout_ms)
+{
+	bool woken = true;
+	unsigned int n;
+	__u32 seen;
+
+	n = ready(ring);
+	while (!n && !atomic_load(&ring->closed) && woken) {
+		atomic_store(waiting, true);
+		seen = atomic_load(events);
+		n = ready(ring);
+		if (!n && !atomic_load(&ring->closed))
+			woken = spsc_ring_futex_wait(events, seen, timeout_ms);
+		atomic_store(waiting, false);
+		n = ready(ring);
+	}
+
+	return n;
+}
+
+int spsc_ring_init(struct spsc_ring *ring, unsigned int size,
+		   size_t slot_size)
+{
+	unsigned int pow2 = 1;
+
+	if (!size || size > (1U << 31))
+		return -EINVAL;
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->size = pow2;
+	ring->slot_size = slot_size;
+	ring->slots = malloc((size_t)pow2 * slot_size);
+	if (!ring->slots)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void spsc_ring_fini(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/* Wake both sides for good, their waits return what is left */
+void spsc_ring_close(struct spsc_ring *ring)
+{
+	atomic_store(&ring->closed, true);
+	atomic_fetch_add(&ring->prod_events, 1);
+	atomic_fetch_add(&ring->cons_events, 1);
+	spsc_ring_futex_wake(&ring->prod_events);
+	spsc_ring_futex_wake(&ring->cons_events);
+}
+
+bool spsc_ring_closed(struct spsc_ring *ring)
+{
+	return atomic_load(&ring->closed);
+}
+
+unsigned int spsc_ring_used(struct spsc_ring *ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+	       atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+unsigned int spsc_ring_free(struct spsc_ring *ring)
+{
+	return ring->size - spsc_ring_used(ring);
+}
+
+/* The number of free slots, 0 only if the ring was closed */
+unsigned int spsc_ring_wait_free(struct spsc_ring *ring)
+{
+	return spsc_ring_wait(ring, &ring->prod_events, &ring->prod_waiting,
+			      spsc_ring_free, -1);
+}
+
+static void *spsc_ring_slot(struct spsc_ring *ring, __u32 index)
+{
+	return ring->slots + (size_t)(index & (ring->size - 1)) *
+			     ring->slot_size;
+}
+
+/* The i-th free slot, to be filled and published */
+void *spsc_ring_prod_slot(struct spsc_ring *ring, unsigned int i)
+{
+	return spsc_ring_slot(ring, atomic_load_explicit(&ring->head,
+						  memory_order_relaxed) + i);
+}
+
+void spsc_ring_publish(struct spsc_ring *ring, unsigned int n)
+{
+	atomic_fetch_add_explicit(&ring->head, n, memory_order_release);
+	spsc_ring_signal(&ring->cons_events, &ring->cons_waiting);
+}
+
+/* The number of published slots, 0 if the ring was closed and drained or
+ * if timeout_ms, unless negative, went by.
+ */
+unsigned int spsc_ring_wait_used(struct spsc_ring *ring, int timeout_ms)
+{
+	return spsc_ring_wait(ring, &ring->cons_events, &ring->cons_waiting,
+			      spsc_ring_used, timeout_ms);
+}
+
+/* The i-th published slot, valid until it is released */
+void *spsc_ring_cons_slot(struct spsc_ring *ring, unsigned int i)
+{
+	return spsc_ring_slot(ring, atomic_load_explicit(&ring->tail,
+						  memory_order_relaxed) + i);
+}
+
+void spsc_ring_release(struct spsc_ring *ring, unsigned int n)
+{
+	atomic_fetch_add_explicit(&ring->tail, n, memory_order_release);
+	spsc_ring_signal(&ring->prod_events, &ring->prod_waiting);
+}
@@ -0,0 +1,53 @@
+/*
+ *   spsc_ring.h	Single producer, single consumer ring of fixed size slots
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+/* head and tail are free running counters, each written by one side only.
+ * A side finding the ring full or empty sleeps on a futex of the other side's
+ * events, and is only woken when it said it was sleeping.
+ */
+struct spsc_ring {
+	_Atomic __u32 head;		/* slots published by the producer */
+	_Atomic __u32 tail;		/* slots released by the consumer */
+	_Atomic __u32 prod_events;	/* releases, for the producer */
+	_Atomic __u32 cons_events;	/* publications, for the consumer */
+	atomic_bool prod_waiting;
+	atomic_bool cons_waiting;
+	atomic_bool closed;
+	unsigned int size;		/* a power of two */
+	size_t slot_size;
+	char *slots;
+};
+
+int spsc_ring_init(struct spsc_ring *ring, unsigned int size,
+		   size_t slot_size);
+void spsc_ring_fini(struct spsc_ring *ring);
+void spsc_ring_close(struct spsc_ring *ring);
+bool spsc_ring_closed(struct spsc_ring *ring);
+unsigned int spsc_ring_used(struct spsc_ring *ring);
+
+/* Producer side */
+unsigned int spsc_ring_free(struct spsc_ring *ring);
+unsigned int spsc_ring_wait_free(struct spsc_ring *ring);
+void *spsc_ring_prod_slot(struct spsc_ring *ring, unsigned int i);
+void spsc_ring_publish(struct spsc_ring *ring, unsigned int n);
+
+/* Consumer side */
+unsigned int spsc_ring_wait_used(struct spsc_ring *ring, int timeout_ms);
+void *spsc_ring_cons_slot(struct spsc_ring *ring, unsigned int i);
+void spsc_ring_release(struct spsc_ring *ring, unsigned int n);
+
+#endif /* _SPSC_RING_H_ */